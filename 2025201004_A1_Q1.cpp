@@ -1,9 +1,46 @@
-#include <fcntl.h>       // open, O_*
-#include <unistd.h>      // read, write, lseek, close, _exit
+#include <fcntl.h>       // open, O_*, fallocate, sync_file_range, posix_fadvise
+#include <unistd.h>      // read, write, pread, pwrite, lseek, ftruncate, fdatasync, unlink, sysconf, close, _exit
 #include <sys/stat.h>    // mkdir
 #include <errno.h>       // errno
 #include <sys/mman.h>    // mmap, munmap
 #include <sys/types.h>   // off_t
+#include <string.h>      // memcpy
+#include <time.h>        // clock_gettime
+#include <sys/socket.h>  // socket, sendmsg, recvmsg, SCM_RIGHTS (--serve/--connect)
+#include <sys/un.h>      // sockaddr_un
+#include <pthread.h>     // worker threads for --serve
+#include <signal.h>      // signal, SIGPIPE
+#include <dirent.h>      // fdopendir, readdir (result cache eviction)
+#include <sys/file.h>    // flock
+#include <sys/ioctl.h>   // ioctl
+#include <linux/fs.h>    // FICLONE
+#include <stdio.h>       // renameat
+#if defined(__SSSE3__)
+#include <immintrin.h>   // SSSE3/AVX2 shuffles for the element reversal kernels
+#endif
+
+//USDT (SystemTap/DTrace-style) static probes. Each one is a single NOP in the code plus a note in
+//.note.stapsdt that perf/bpftrace use to attach at run time. Probes only pass values the code already
+//has (no timestamps), so nothing runs until a tracer attaches; latencies are begin->end deltas, e.g.
+//    bpftrace -e 'usdt:./q1:q1:write_begin { @t[tid]=nsecs; } usdt:./q1:q1:write_end /@t[tid]/ { @lat=hist(nsecs-@t[tid]); }' -p <pid>
+//Without <sys/sdt.h> (or with -DNO_SDT) the probes compile away entirely.
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+#ifndef HAVE_SDT
+#define DTRACE_PROBE2(provider,name,a,b) do { (void)(a); (void)(b); } while(0)
+#define DTRACE_PROBE3(provider,name,a,b,c) do { (void)(a); (void)(b); (void)(c); } while(0)
+#endif
+
+//Per-thread job environment. A command-line run uses the process's own stdout/stderr and working
+//directory; a --serve worker points these at the descriptors its client passed before each job.
+thread_local int jobOut=1;
+thread_local int jobErr=2;
+thread_local int jobDir=AT_FDCWD;   //directory that relative paths (input, Assignment1/...) resolve against
+thread_local int jobInput=-1;       //input already opened by the client, or -1 to open the path
 
 // ----------------UTILITY FUNCTIONS---------------
 
@@ -73,381 +110,2159 @@ void fdWriteInt(int fd, int num)
     write(fd,buffer+i+1,11-i-1);
 }
 
-//Prints correct usage syntax if the input command syntax does not match
-void printUsage()
+//Formatting a 64-bit integer into dst (at least 21 bytes, NUL-terminated); returns its length
+int longToStr(char* dst, long long num)
 {
-    fdWriteStr(2,"Usage:\n");
-    fdWriteStr(2,"./a.out <input_file> 0 <block_size>\n");
-    fdWriteStr(2,"./a.out <input_file> 1\n");
-    fdWriteStr(2,"./a.out <input_file> 2 <start_index> <end_index>\n");
+    char digits[20];
+    int n=0,len=0;
+    unsigned long long v=num;
+    if(num<0)
+    {
+        dst[len++]='-';
+        v=-(unsigned long long)num;
+    }
+    do
+    {
+        digits[n++]='0'+(v%10);
+        v/=10;
+    } while(v>0);
+    while(n>0)
+    {
+        dst[len++]=digits[--n];
+    }
+    dst[len]='\0';
+    return len;
 }
 
-//-----------------MAIN------------------
+//Writing a 64-bit integer (offsets, byte counts) to a file descriptor
+void fdWriteLong(int fd, long long num)
+{
+    char buffer[21];
+    write(fd,buffer,longToStr(buffer,num));
+}
 
-int main(int argc, char* argv[])
+//Comparing two strings for equality
+bool strEqual(const char* a, const char* b)
 {
-    if(argc<3)
+    int i=0;
+    while(a[i] && a[i]==b[i])
     {
-        printUsage();
-        _exit(1);
+        i++;
     }
+    return a[i]==b[i];
+}
 
-    const char* inputFile=argv[1];
-    int mode=convertToInt(argv[2]);
-
-    //Validating args per mode
-    int blockSize=0,start=0,end=0;
-    if(mode==0)
+//Reading exactly n bytes at offset off; returns the number of bytes read (short only at EOF or on error)
+ssize_t preadFull(int fd, char* buf, ssize_t n, off_t off)
+{
+    ssize_t done=0;
+    while(done<n)
     {
-        if(argc!=4)
+        ssize_t r=pread(fd,buf+done,n-done,off+done);
+        if(r<=0)
         {
-            fdWriteStr(2,"Flag 0 requires block size.\n");
-            printUsage();
-            _exit(1);
+            break;
         }
-        blockSize=convertToInt(argv[3]);
-        if(blockSize<=0)
+        done+=r;
+    }
+    return done;
+}
+
+//Writing exactly n bytes at offset off; returns the number of bytes written
+ssize_t pwriteFull(int fd, const char* buf, ssize_t n, off_t off)
+{
+    ssize_t done=0;
+    while(done<n)
+    {
+        ssize_t w=pwrite(fd,buf+done,n-done,off+done);
+        if(w<=0)
         {
-            fdWriteStr(2,"Invalid block size.\n");
-            _exit(1);
+            break;
         }
-        if(blockSize>8*1024*1024)
+        done+=w;
+    }
+    return done;
+}
+
+//-----------------ELEMENT KERNELS------------------
+
+//Reversal works on W-byte elements (W = 1, 2, 4, 8 or 16): the order of the elements is reversed, the
+//bytes inside each element are kept. W = 1 is plain byte reversal. Each width gets its own kernel,
+//specialised at compile time; the vector paths shuffle 16-byte lanes with masks built per width.
+
+//pshufb masks for two 16-byte lanes: rev reverses the order of the W-byte elements within each lane,
+//swap reverses the bytes within each element
+template<int W>
+struct LaneMasks
+{
+    unsigned char rev[32],swap[32];
+    constexpr LaneMasks() : rev(), swap()
+    {
+        for(int k=0;k<32;k++)
         {
-            fdWriteStr(2,"Warning: block > *MB.\n");
-            _exit(1);
+            int l=k%16;
+            rev[k]=(unsigned char)((16/W-1-l/W)*W+l%W);
+            swap[k]=(unsigned char)((l/W)*W+(W-1-l%W));
         }
     }
-    else if(mode==1)
+};
+template<int W> constexpr LaneMasks<W> laneMasks=LaneMasks<W>();
+
+//Reversing the order of the W-byte elements of buf[0...n-1] in place (n a multiple of W).
+//Vectors are taken from both ends, element-reversed in-register and stored crosswise.
+template<int W>
+void reverseElems(char* buf, ssize_t n)
+{
+    ssize_t i=0,j=n; //next front element at i, back elements end at j
+#if defined(__AVX2__)
+    const __m256i m=_mm256_loadu_si256((const __m256i*)laneMasks<W>.rev);
+    while(j-i>=64)
     {
-        if(argc!=3)
-        {
-            fdWriteStr(2,"Flag 1 takes no extra args.\n");
-            printUsage();
-            _exit(1);
-        } 
-        blockSize = 1024*1024;
+        __m256i f=_mm256_loadu_si256((const __m256i*)(buf+i));
+        __m256i b=_mm256_loadu_si256((const __m256i*)(buf+j-32));
+        f=_mm256_permute4x64_epi64(_mm256_shuffle_epi8(f,m),0x4E); //reverse in lanes, then swap lanes
+        b=_mm256_permute4x64_epi64(_mm256_shuffle_epi8(b,m),0x4E);
+        _mm256_storeu_si256((__m256i*)(buf+i),b);
+        _mm256_storeu_si256((__m256i*)(buf+j-32),f);
+        i+=32;
+        j-=32;
     }
-    else if(mode==2)
+#elif defined(__SSSE3__)
+    const __m128i m=_mm_loadu_si128((const __m128i*)laneMasks<W>.rev);
+    while(j-i>=32)
     {
-        if (argc!=5)
+        __m128i f=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buf+i)),m);
+        __m128i b=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buf+j-16)),m);
+        _mm_storeu_si128((__m128i*)(buf+i),b);
+        _mm_storeu_si128((__m128i*)(buf+j-16),f);
+        i+=16;
+        j-=16;
+    }
+#endif
+    if(W==1)
+    {
+        //Portable byte path: 8 bytes from each end at a time via byte swap
+        while(j-i>=16)
         {
-            fdWriteStr(2,"Flag 2 requires start and end indices.\n");
-            printUsage();
-            _exit(1);
+            unsigned long long f,b;
+            memcpy(&f,buf+i,8);
+            memcpy(&b,buf+j-8,8);
+            f=__builtin_bswap64(f);
+            b=__builtin_bswap64(b);
+            memcpy(buf+i,&b,8);
+            memcpy(buf+j-8,&f,8);
+            i+=8;
+            j-=8;
         }
-        start=convertToInt(argv[3]);
-        end=convertToInt(argv[4]);
-        if(start<0 || end<0 || start>=end)
+    }
+    while(j-i>=2*W)
+    {
+        char t[W];
+        memcpy(t,buf+i,W);
+        memcpy(buf+i,buf+j-W,W);
+        memcpy(buf+j-W,t,W);
+        i+=W;
+        j-=W;
+    }
+}
+
+//Reversing the bytes inside every W-byte element of buf[0...n-1] (endianness conversion, order kept)
+template<int W>
+void swapElems(char* buf, ssize_t n)
+{
+    ssize_t i=0;
+#if defined(__AVX2__)
+    const __m256i m=_mm256_loadu_si256((const __m256i*)laneMasks<W>.swap);
+    for(;i+32<=n;i+=32)
+    {
+        __m256i v=_mm256_loadu_si256((const __m256i*)(buf+i));
+        _mm256_storeu_si256((__m256i*)(buf+i),_mm256_shuffle_epi8(v,m));
+    }
+#elif defined(__SSSE3__)
+    const __m128i m=_mm_loadu_si128((const __m128i*)laneMasks<W>.swap);
+    for(;i+16<=n;i+=16)
+    {
+        __m128i v=_mm_loadu_si128((const __m128i*)(buf+i));
+        _mm_storeu_si128((__m128i*)(buf+i),_mm_shuffle_epi8(v,m));
+    }
+#endif
+    for(;i+W<=n;i+=W)
+    {
+        for(int k=0;k<W/2;k++)
         {
-            fdWriteStr(2,"Invalid start/end indices.\n");
-            _exit(1);
+            char t=buf[i+k];
+            buf[i+k]=buf[i+W-1-k];
+            buf[i+W-1-k]=t;
         }
-        blockSize=1024*1024; //chunk size for revresed parts
     }
-    else
+}
+
+//Dispatching to the kernel for a run-time element width
+void reverseElements(char* buf, ssize_t n, int width)
+{
+    switch(width)
     {
-        fdWriteStr(2,"Only flags 0, 1, 2 supported.\n");
-        _exit(1);
+        case 2: reverseElems<2>(buf,n); break;
+        case 4: reverseElems<4>(buf,n); break;
+        case 8: reverseElems<8>(buf,n); break;
+        case 16: reverseElems<16>(buf,n); break;
+        default: reverseElems<1>(buf,n); break;
     }
-    
-    //Ensure Assignment1 directory
-    if(mkdir("Assignment1",0700)==-1 && errno!=EEXIST)
+}
+
+void swapElements(char* buf, ssize_t n, int width)
+{
+    switch(width)
     {
-        fdWriteStr(2,"Assignment1 dirctory creation failed!\n");
-        _exit(1);
+        case 2: swapElems<2>(buf,n); break;
+        case 4: swapElems<4>(buf,n); break;
+        case 8: swapElems<8>(buf,n); break;
+        case 16: swapElems<16>(buf,n); break;
+        default: break;
     }
+}
 
-    //Open input
-    int fd_in=open(inputFile,O_RDONLY);
-    if(fd_in==-1)
+//Checking that an element width is one of the supported ones
+bool validWidth(int width)
+{
+    return width==1 || width==2 || width==4 || width==8 || width==16;
+}
+
+//64-bit fingerprint of a byte range (multiply/xor-shift mix over 8-byte words), seeded with the length
+unsigned long long fingerprint(const char* buf, ssize_t n)
+{
+    const unsigned long long mul=0xff51afd7ed558ccdULL;
+    unsigned long long h=0x9e3779b97f4a7c15ULL^(unsigned long long)n;
+    ssize_t i=0;
+    for(;i+8<=n;i+=8)
     {
-        fdWriteStr(2,"Failed to open input!\n");
-        _exit(1);
+        unsigned long long w;
+        memcpy(&w,buf+i,8);
+        h=(h^w)*mul;
+        h^=h>>32;
     }
+    unsigned long long w=0;
+    memcpy(&w,buf+i,n-i);
+    h=(h^w)*mul;
+    h^=h>>29;
+    return h;
+}
 
-    //Build output path: Assignment1/<flag>_<input_file_name>
-    const char* baseName=inputFile;
-    for(int i=0;inputFile[i]!='\0';i++)
+//Parsing "<i>/<N>" for --shard; returns false unless 0 <= i < N <= 65536
+bool parseShard(const char* str, int* index, int* count)
+{
+    char part[12];
+    int i=0;
+    while(str[i] && str[i]!='/' && i<11)
     {
-        if(inputFile[i]=='/')
+        part[i]=str[i];
+        i++;
+    }
+    if(str[i]!='/' || i==0)
+    {
+        return false;
+    }
+    part[i]='\0';
+    *index=convertToInt(part);
+    *count=convertToInt(str+i+1);
+    return *index>=0 && *count>0 && *count<=65536 && *index<*count;
+}
+
+//Building "Assignment1/<prefix><flag>_<base_name><suffix>" into dst (512 bytes); returns false if it does not fit
+bool buildOutputPath(char* dst, const char* prefix, int mode, const char* baseName, const char* suffix)
+{
+    char flagPart[3]={(char)('0'+mode),'_','\0'};
+    const char* parts[5]={"Assignment1/",prefix,flagPart,baseName,suffix};
+    int pos=0;
+    for(int p=0;p<5;p++)
+    {
+        for(int i=0;parts[p][i];i++)
         {
-            baseName=inputFile+i+1;
+            if(pos>=511)
+            {
+                return false;
+            }
+            dst[pos++]=parts[p][i];
         }
     }
-    char outputPath[512];
-    int pos=0;
-    const char* folder="Assignment1/";
-    for(int i=0;folder[i];i++)
+    dst[pos]='\0';
+    return true;
+}
+
+//-----------------WRITEBACK CONTROL------------------
+
+//Output writeback pipeline: each completed window of output is handed to the kernel with
+//sync_file_range(WRITE) as soon as it fills, then waited for and dropped from the page cache
+//FLUSH_LAG windows later. Dirty data stays bounded at ~(FLUSH_LAG+1) windows, so the writer
+//is never throttled by a dirty-page storm and other processes keep their cache.
+const int FLUSH_LAG=4;
+const off_t FLUSH_WINDOW=16*1024*1024;
+
+struct Flusher
+{
+    int fd;
+    off_t curOff,curLen;                            //window being filled
+    off_t pendOff[FLUSH_LAG],pendLen[FLUSH_LAG];    //windows under writeback, oldest at head
+    int head,count;
+};
+
+void flusherInit(Flusher* f, int fd)
+{
+    f->fd=fd;
+    f->curOff=0;
+    f->curLen=0;
+    f->head=0;
+    f->count=0;
+}
+
+//Waiting for the oldest window under writeback and dropping its pages
+void flusherRetire(Flusher* f)
+{
+    off_t off=f->pendOff[f->head],len=f->pendLen[f->head];
+    sync_file_range(f->fd,off,len,SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(f->fd,off,len,POSIX_FADV_DONTNEED);
+    f->head=(f->head+1)%FLUSH_LAG;
+    f->count--;
+}
+
+//Starting writeback of the current window
+void flusherSubmit(Flusher* f)
+{
+    if(f->curLen==0)
     {
-        outputPath[pos]=folder[i];
-        pos++;
+        return;
     }
-    outputPath[pos++]='0'+mode;
-    outputPath[pos++]='_';
-    for(int i=0;baseName[i];i++)
+    sync_file_range(f->fd,f->curOff,f->curLen,SYNC_FILE_RANGE_WRITE);
+    if(f->count==FLUSH_LAG)
     {
-        outputPath[pos]=baseName[i];
-        pos++;
+        flusherRetire(f);
     }
-    outputPath[pos]='\0';
+    int slot=(f->head+f->count)%FLUSH_LAG;
+    f->pendOff[slot]=f->curOff;
+    f->pendLen[slot]=f->curLen;
+    f->count++;
+    f->curLen=0;
+}
 
-    //Open output
-    int fd_out=open(outputPath,O_CREAT|O_WRONLY|O_TRUNC,0600);
-    if(fd_out==-1)
+//Recording that [off, off+len) of the output has been written; non-contiguous writes close the current window
+void flusherAdd(Flusher* f, off_t off, off_t len)
+{
+    if(f->curLen>0 && off!=f->curOff+f->curLen)
     {
-        fdWriteStr(2,"Failed to open output\n");
-        close(fd_in);
-        _exit(1);
+        flusherSubmit(f);
+    }
+    if(f->curLen==0)
+    {
+        f->curOff=off;
+    }
+    f->curLen+=len;
+    if(f->curLen>=FLUSH_WINDOW)
+    {
+        flusherSubmit(f);
     }
+}
 
-    //Get file size
-    off_t fileSize=lseek(fd_in,0,SEEK_END);
-    if(fileSize==(off_t)-1)
+//Pushing out the last window and waiting for every window still under writeback
+void flusherFinish(Flusher* f)
+{
+    flusherSubmit(f);
+    while(f->count>0)
     {
-        fdWriteStr(2,"Failed to get file size!\n");
-        close(fd_in);
-        close(fd_out);
-        _exit(1);
+        flusherRetire(f);
     }
+}
 
-    if(mode==2 && (start>=fileSize || end>=fileSize || start>=end))
+//Prints correct usage syntax if the input command syntax does not match
+void printUsage()
+{
+    fdWriteStr(jobErr,"Usage:\n");
+    fdWriteStr(jobErr,"./a.out <input_file> 0 <block_size> [--incremental] [--durable] [--shard <i>/<N>]\n");
+    fdWriteStr(jobErr,"./a.out <input_file> 1 [--durable] [--shard <i>/<N>]\n");
+    fdWriteStr(jobErr,"./a.out <input_file> 2 <start_index> <end_index> [--durable] [--shard <i>/<N>]\n");
+    fdWriteStr(jobErr,"./a.out <input_file> <flag> [flag args] --finalize <N>\n");
+    fdWriteStr(jobErr,"Flags 1 and 2 also take [--chunk <bytes>] [--tile <bytes>] to override the tuned sizes.\n");
+    fdWriteStr(jobErr,"Any flag takes [--width <1|2|4|8|16>] [--bswap] to reverse W-byte elements (optionally byte-swapped).\n");
+    fdWriteStr(jobErr,"Full runs take [--cache <dir>] [--cache-size <MiB>] to reuse results of earlier identical jobs.\n");
+    fdWriteStr(jobErr,"./a.out --serve <socket> [--workers <N>] [--queue <N>]\n");
+    fdWriteStr(jobErr,"./a.out --connect <socket> <input_file> <flag> [flag args] [options]\n");
+}
+
+//-----------------CHUNK SIZE TUNING------------------
+
+//Modes 1 and 2 pick their I/O chunk at run time. The first candidate comes from the preferred I/O size
+//of the input/output (st_blksize, which reflects e.g. the stripe width on striped volumes); the largest
+//candidate is bounded by available memory. Over the first TUNE_BUDGET bytes each candidate is timed for
+//at least TUNE_PROBE bytes and the chunk keeps doubling until throughput drops; the best one is then
+//kept for the rest of the run. Reversal happens in cache-resident tiles (about half of L2) inside the chunk.
+const off_t TUNE_MIN_CHUNK=256*1024;
+const off_t TUNE_MAX_CHUNK=64*1024*1024;
+const off_t TUNE_PROBE=16*1024*1024;
+const off_t TUNE_BUDGET=384*1024*1024;
+
+struct Tuner
+{
+    off_t chunk;            //I/O chunk in use
+    off_t maxChunk;         //largest chunk that may be tried (the buffer is this big)
+    off_t tile;             //reversal tile
+    bool settled,manual;
+    off_t probeBytes;       //bytes moved with the current candidate
+    long long probeStart;   //when the current candidate started (ns)
+    off_t spent;            //bytes moved while tuning
+    off_t bestChunk;
+    double bestRate;
+};
+
+//Monotonic clock in nanoseconds
+long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+//Largest power of two <= v (v >= 1)
+off_t floorPow2(off_t v)
+{
+    off_t p=1;
+    while(p*2<=v)
     {
-        fdWriteStr(2,"Start/end indices out of range!\n");
-        close(fd_in);
-        close(fd_out);
-        _exit(1);
+        p*=2;
     }
+    return p;
+}
 
-    //Map buffer for chunk operations
-    char* buffer=(char*)mmap(NULL,blockSize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-    if(buffer==MAP_FAILED)
+//Setting up the tuner. fixedChunk/fixedTile (0 = automatic) come from --chunk/--tile; a fixed chunk
+//disables measuring altogether.
+void tunerInit(Tuner* t, int fd_in, int fd_out, off_t fixedChunk, off_t fixedTile)
+{
+    struct stat st;
+    off_t hint=0;
+    if(fstat(fd_in,&st)==0)
     {
-        fdWriteStr(2,"Buffer allocation failed!\n");
-        close(fd_in);
-        close(fd_out);
-        _exit(1);
+        hint=st.st_blksize;
+    }
+    if(fstat(fd_out,&st)==0 && st.st_blksize>hint)
+    {
+        hint=st.st_blksize;
+    }
+    off_t first=TUNE_MIN_CHUNK;
+    while(first<hint*4 && first<TUNE_MAX_CHUNK)
+    {
+        first*=2;
+    }
+    off_t avail=(off_t)sysconf(_SC_AVPHYS_PAGES)*sysconf(_SC_PAGESIZE);
+    t->maxChunk=TUNE_MAX_CHUNK;
+    while(t->maxChunk>first && avail>0 && t->maxChunk>avail/64)
+    {
+        t->maxChunk/=2;
     }
 
-    //Reset input pointer for sequential reads
-    lseek(fd_in,0,SEEK_SET);
+    long l2=sysconf(_SC_LEVEL2_CACHE_SIZE);
+    t->tile=(l2>0)?floorPow2(l2/2):256*1024;
+    if(t->tile<16*1024)
+    {
+        t->tile=16*1024;
+    }
+    if(t->tile>4*1024*1024)
+    {
+        t->tile=4*1024*1024;
+    }
+    if(fixedTile>0)
+    {
+        t->tile=fixedTile;
+    }
 
-    //-----------------------FLAG IMPLEMENTATIONS-------------------------
-    if(mode==0) //Block-wise reversal
+    t->chunk=first;
+    t->manual=(fixedChunk>0);
+    if(t->manual)
     {
-        off_t totalBlocks=(fileSize+blockSize-1)/blockSize,doneBlocks=0;
+        t->chunk=fixedChunk;
+        t->maxChunk=fixedChunk;
+    }
+    t->settled=t->manual;
+    t->probeBytes=0;
+    t->probeStart=nowNs();
+    t->spent=0;
+    t->bestChunk=t->chunk;
+    t->bestRate=0;
+}
 
-        while(doneBlocks<totalBlocks)
-        {
-            ssize_t sz=blockSize;
-            off_t left=fileSize-doneBlocks*blockSize;
-            if(left<blockSize)
-            {
-                sz=left;
-            }
+//Fixed chunk (flag 0 groups of whole blocks)
+void tunerFixed(Tuner* t, off_t chunk, off_t tile)
+{
+    t->chunk=chunk;
+    t->maxChunk=chunk;
+    t->tile=tile;
+    t->settled=true;
+    t->manual=true;
+}
 
-            ssize_t rbytes=0;
-            while(rbytes<sz)
-            {
-                ssize_t r=read(fd_in,buffer+rbytes,sz-rbytes);
-                if(r<=0)
-                {
-                    break;
-                }
-                rbytes+=r;
-            }
-            if(rbytes==0)
-            {
-                break;
-            }
+//Accounting for bytes moved with the current chunk; moves on to the next candidate once a probe is complete
+void tunerRecord(Tuner* t, off_t bytes)
+{
+    if(t->settled)
+    {
+        return;
+    }
+    t->probeBytes+=bytes;
+    t->spent+=bytes;
+    off_t probeLen=(t->chunk*4>TUNE_PROBE)?t->chunk*4:TUNE_PROBE;
+    if(t->probeBytes<probeLen)
+    {
+        return;
+    }
+    long long now=nowNs();
+    double rate=(double)t->probeBytes/(double)(now-t->probeStart+1);
+    bool worse=(rate<t->bestRate*0.95); //small dips are measurement noise, keep climbing through them
+    if(rate>t->bestRate)
+    {
+        t->bestRate=rate;
+        t->bestChunk=t->chunk;
+    }
+    if(!worse && t->chunk*2<=t->maxChunk && t->spent<TUNE_BUDGET)
+    {
+        t->chunk*=2;
+        t->probeBytes=0;
+        t->probeStart=nowNs();
+        return;
+    }
+    t->chunk=t->bestChunk;
+    t->settled=true;
+}
 
-            //Reverse this block
-            for(ssize_t i=0;i<rbytes/2;i++)
-            {
-                char t=buffer[i];
-                buffer[i]=buffer[rbytes-i-1];
-                buffer[rbytes-i-1]=t;
-            }
+//Reporting the chosen sizes. The chunk is "initial" when the input ended before any probe finished,
+//and the tile is the one processRange() really used, which never exceeds the chunk.
+void tunerReport(const Tuner* t)
+{
+    off_t chunk=t->settled?t->chunk:t->bestChunk;
+    fdWriteStr(jobOut,"I/O chunk: ");
+    fdWriteLong(jobOut,chunk);
+    fdWriteStr(jobOut,t->manual?" bytes (fixed)":(t->bestRate>0?" bytes (tuned)":" bytes (initial)"));
+    fdWriteStr(jobOut,", reversal tile: ");
+    fdWriteLong(jobOut,(t->tile<chunk)?t->tile:chunk);
+    fdWriteStr(jobOut," bytes\n");
+}
 
-            //Write out
-            ssize_t wbytes=0;
-            while(wbytes<rbytes)
-            {
-                ssize_t w=write(fd_out,buffer+wbytes,rbytes-wbytes);
-                if(w<=0)
-                {
-                    break;
-                }
-                wbytes+=w;
-            }
+//-----------------REVERSAL CORE------------------
 
-            doneBlocks++;
+//What a job does to its input: the flag with its arguments, and the element layout.
+//With bswap every element of the output is also byte-swapped, so reversed segments end up fully
+//byte-reversed and copied segments (flag 2 middle) are converted element by element.
+struct Transform
+{
+    int mode;
+    int blockSize;      //flag 0 block size
+    off_t start,end;    //flag 2 range kept in order
+    int width;          //element width in bytes
+    bool bswap;
+};
 
-            //Progress
-            write(1,"\rProgress: ",11);
-            fdWriteInt(1,(int)((doneBlocks*100)/totalBlocks));
-            write(1,"%",1);
-        }
-    }
-    else if(mode==1) //Full file reversal
+//Element width used when reversing (a byte-swapped element reversal is a plain byte reversal)
+int reverseWidth(const Transform* tf)
+{
+    return tf->bswap?1:tf->width;
+}
+
+//Unit in which flag 0 is read and written: the largest whole number of blocks that fits in 1 MB
+//(or one block, if blocks are larger), so tiny blocks do not cost one system call each
+long blockGroup(int blockSize)
+{
+    const long unit=1024*1024;
+    if(blockSize>=unit)
     {
-        off_t processed=0,remaining=fileSize;
+        return blockSize;
+    }
+    return (unit/blockSize)*blockSize;
+}
 
-        while(remaining>0)
+//Producing output bytes [lo, hi) for any flag. The output is split into segments that are either
+//reversed or copied as a whole: every block for flag 0, the whole file for flag 1, and
+//[0,start) / [start,end] / (end,EOF) for flag 2. For a reversed segment [a,b), output bytes
+//[o, o+sz) are input bytes [a+b-o-sz, a+b-o) reversed. The output is written front to back in
+//chunks of the tuner's current size with one pwrite each. A reversed chunk is read tile by tile,
+//starting from the end of its source range, and each tile is reversed right after it is read
+//while it is still in cache. Returns 0 on success, -1 on I/O failure.
+//Probes: read_begin/read_end (input offset, size[, ns]), reverse_begin/reverse_end and
+//write_begin/write_end (output offset, size[, ns]), mode2_part (part 0/1/2 for A/B/C, offset, length).
+int processRange(int fd_in, int fd_out, Flusher* flusher, char* buffer, Tuner* tuner,
+                 const Transform* tf, off_t fileSize, off_t lo, off_t hi)
+{
+    int mode=tf->mode,blockSize=tf->blockSize,width=reverseWidth(tf);
+    off_t start=tf->start,end=tf->end;
+    off_t pos=lo;
+    int lastPart=-1;
+    while(pos<hi)
+    {
+        off_t a=0,b=fileSize;
+        bool reversed=true;
+        int part=0;
+        ssize_t sz=tuner->chunk;
+        if(mode==0)
         {
-            ssize_t sz;
-            if(remaining>=blockSize)
-            {
-                 sz=blockSize;
-            }
-            else
+            //Whole blocks only (lo is block aligned); each block is reversed separately below
+            a=pos;
+            b=fileSize;
+            reversed=false;
+        }
+        else if(mode==2)
+        {
+            if(pos<start)
             {
-                sz=remaining;
+                b=start;
             }
-        
-            if(lseek(fd_in,remaining-sz,SEEK_SET)==(off_t)-1)
+            else if(pos<=end)
             {
-                break;
+                a=start;
+                b=end+1;
+                reversed=false;
+                part=1;
             }
-            ssize_t rbytes=0;
-            while(rbytes<sz)
+            else
             {
-                ssize_t r=read(fd_in,buffer+rbytes,sz-rbytes);
-                if(r<=0)
-                {
-                    break;
-                }
-                rbytes+=r;
+                a=end+1;
+                part=2;
             }
-            for(ssize_t i=0;i<rbytes/2;i++)
+            if(part!=lastPart)
             {
-                char t=buffer[i];
-                buffer[i]=buffer[rbytes-i-1];
-                buffer[rbytes-i-1]=t;
+                DTRACE_PROBE3(q1,mode2_part,part,a,b-a);
+                lastPart=part;
             }
-            ssize_t wbytes=0;
-            while(wbytes<rbytes)
+        }
+        if(b-pos<sz)
+        {
+            sz=b-pos;
+        }
+        if(hi-pos<sz)
+        {
+            sz=hi-pos;
+        }
+
+        if(reversed)
+        {
+            for(ssize_t done=0;done<sz;done+=tuner->tile)
             {
-                ssize_t w=write(fd_out,buffer+wbytes,rbytes-wbytes);
-                if(w<=0)
+                ssize_t t=(sz-done<tuner->tile)?sz-done:tuner->tile;
+                off_t src=a+b-pos-done-t;
+                DTRACE_PROBE2(q1,read_begin,src,t);
+                if(preadFull(fd_in,buffer+done,t,src)!=t)
                 {
-                    break;
+                    return -1;
                 }
-                wbytes+=w;
+                DTRACE_PROBE2(q1,read_end,src,t);
+                DTRACE_PROBE2(q1,reverse_begin,pos+done,t);
+                reverseElements(buffer+done,t,width);
+                DTRACE_PROBE2(q1,reverse_end,pos+done,t);
             }
-            processed+=rbytes;
-            remaining-=rbytes;
-
-            //Progress
-            write(1,"\rProgress: ",11);
-            fdWriteInt(1,(int)((processed*100)/fileSize));
-            write(1,"%",1);
         }
-    }
-    else if(mode==2) //Partial range reversal
-    {
-        //Part A: Reverse [0...start_index-1]
-        off_t leftA=start; //count number of bytes to reverse
-        off_t frontPos=0;
-        off_t backPos=start-1;
-        while(frontPos<backPos)
+        else
         {
-            ssize_t chunk;
-            if(blockSize<(backPos-frontPos+1)/2)
-            {
-                chunk=blockSize;
-            }
-            else
-            {
-                chunk=(backPos-frontPos+1)/2;
-            }
-
-            //Read front
-            lseek(fd_in,frontPos,SEEK_SET);
-            read(fd_in,buffer,chunk);
-            //Read back
-            lseek(fd_in,backPos-chunk+1,SEEK_SET);
-            char* buffer2=(char*)mmap(NULL,chunk,PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-            read(fd_in,buffer2,chunk);
-
-            //Swap
-            for(int i=0;i<chunk;i++)
-            {
-                char t=buffer[i];
-                buffer[i]=buffer2[chunk-i-1];
-                buffer2[chunk-i-1]=t;
-            }
-            //Write swapped portion
-            lseek(fd_out,frontPos,SEEK_SET);
-            write(fd_out,buffer,chunk);
-            lseek(fd_out,backPos-chunk+1,SEEK_SET);
-            write(fd_out,buffer2,chunk);
-            munmap(buffer2,chunk);
-            frontPos+=chunk;
-            backPos-=chunk;
-        }
-
-        //Part B: Copy [start_index....end_index]
-        lseek(fd_in,start,SEEK_SET);
-        lseek(fd_out,start,SEEK_SET);
-        off_t middleSize=end-start+1;
-        while(middleSize>0)
-        {
-            ssize_t sz;
-            if(middleSize>=blockSize)
+            DTRACE_PROBE2(q1,read_begin,pos,sz);
+            if(preadFull(fd_in,buffer,sz,pos)!=sz)
             {
-                sz=blockSize;
+                return -1;
             }
-            else
+            DTRACE_PROBE2(q1,read_end,pos,sz);
+            if(mode==0)
             {
-                sz=middleSize;
+                DTRACE_PROBE2(q1,reverse_begin,pos,sz);
+                for(ssize_t i=0;i<sz;i+=blockSize)
+                {
+                    reverseElements(buffer+i,(sz-i<blockSize)?sz-i:blockSize,width);
+                }
+                DTRACE_PROBE2(q1,reverse_end,pos,sz);
             }
-            ssize_t r=read(fd_in,buffer,sz);
-            if(r<=0)
+            else if(tf->bswap)
             {
-                break;
+                swapElements(buffer,sz,tf->width);
             }
-            write(fd_out,buffer,r);
-            middleSize-=r;
         }
-
-        //Part C: Revrese [end_index+1......EOF]
-        off_t front=end+1;
-        off_t back=fileSize-1;
-        while(front<back)
+        DTRACE_PROBE2(q1,write_begin,pos,sz);
+        if(pwriteFull(fd_out,buffer,sz,pos)!=sz)
         {
-            ssize_t chunk;
-            if(blockSize<(back-front+1)/2)
-            {
-                chunk=blockSize;
-            }
-            else
-            {
-                chunk=(back-front+1)/2;
-            }
-            lseek(fd_in,front,SEEK_SET);
-            read(fd_in,buffer,chunk);
-            lseek(fd_in,back-chunk+1,SEEK_SET);
-            char* buffer2=(char*)mmap(NULL,chunk,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-            read(fd_in,buffer2,chunk);
-
-            for(int i=0;i<chunk;i++)
-            {
-                char t=buffer[i];
-                buffer[i]=buffer2[chunk-i-1];
-                buffer2[chunk-i-1]=t;
-            }
-            lseek(fd_out,front,SEEK_SET);
-            write(fd_out,buffer,chunk);
-            lseek(fd_out,back-chunk+1,SEEK_SET);
-            write(fd_out,buffer2,chunk);
-            munmap(buffer2,chunk);
-            front+=chunk;
-            back-=chunk;
+            return -1;
         }
+        DTRACE_PROBE2(q1,write_end,pos,sz);
+        flusherAdd(flusher,pos,sz);
+        tunerRecord(tuner,sz);
+        pos+=sz;
+
+        //Progress
+        write(jobOut,"\rProgress: ",11);
+        fdWriteInt(jobOut,(int)(((pos-lo)*100)/(hi-lo)));
+        write(jobOut,"%",1);
     }
-    write(1,"\n",1);
-    munmap(buffer,blockSize);
-    close(fd_in);
-    close(fd_out);
     return 0;
+}
+
+//-----------------SHARDED EXECUTION------------------
+
+//With --shard i/N, each process owns a disjoint range of output offsets and writes it with pwrite into
+//the shared, preallocated output. A finished shard leaves Assignment1/.<flag>_<name>.shard<i>
+//recording what it did; --finalize N checks those records and removes them.
+const long SHARD_MAGIC=0x32445253;
+const int SHARD_FIELDS=14; //{magic, mode, blockSize, start, end, width, bswap, inputSize, mtime sec, mtime nsec, N, i, lo, hi}
+
+//Output byte range [lo, hi) owned by shard i of n: an even split rounded down to a multiple of align
+//(the block size for flag 0, a page otherwise) so that no block or page is written by two shards
+void shardRange(off_t fileSize, int i, int n, off_t align, off_t* lo, off_t* hi)
+{
+    *lo=(i==0)?0:(fileSize*i/n)/align*align;
+    *hi=(i==n-1)?fileSize:(fileSize*(i+1)/n)/align*align;
+}
+
+//Building the completion marker path of shard i
+bool buildMarkerPath(char* dst, int mode, const char* baseName, int i)
+{
+    char suffix[32]=".shard";
+    longToStr(suffix+6,i);
+    return buildOutputPath(dst,".",mode,baseName,suffix);
+}
+
+//Filling a shard record for the current job
+void fillShardRecord(long* rec, const Transform* tf, const struct stat* st_in, int count, int index, off_t lo, off_t hi)
+{
+    rec[0]=SHARD_MAGIC;
+    rec[1]=tf->mode;
+    rec[2]=tf->blockSize;
+    rec[3]=tf->start;
+    rec[4]=tf->end;
+    rec[5]=tf->width;
+    rec[6]=tf->bswap;
+    rec[7]=st_in->st_size;
+    rec[8]=st_in->st_mtim.tv_sec;
+    rec[9]=st_in->st_mtim.tv_nsec;
+    rec[10]=count;
+    rec[11]=index;
+    rec[12]=lo;
+    rec[13]=hi;
+}
+
+//Alignment of shard boundaries: a whole block for flag 0, a page (a multiple of every element width) otherwise
+off_t shardAlign(const Transform* tf)
+{
+    return (tf->mode==0)?tf->blockSize:4096;
+}
+
+//--finalize N: every shard must have left a record for this exact job (same transform, same unmodified
+//input) and together the records must cover the output without gaps. Returns 0 when complete.
+int runFinalize(const Transform* tf, const struct stat* st_in, const char* baseName, int count)
+{
+    int mode=tf->mode;
+    off_t align=shardAlign(tf);
+    int missing=0;
+    char markerPath[512];
+    for(int i=0;i<count;i++)
+    {
+        long expect[SHARD_FIELDS],rec[SHARD_FIELDS];
+        off_t lo,hi;
+        shardRange(st_in->st_size,i,count,align,&lo,&hi);
+        fillShardRecord(expect,tf,st_in,count,i,lo,hi);
+        bool done=false;
+        int fd=buildMarkerPath(markerPath,mode,baseName,i)?openat(jobDir,markerPath,O_RDONLY):-1;
+        if(fd!=-1)
+        {
+            done=(preadFull(fd,(char*)rec,sizeof(rec),0)==(ssize_t)sizeof(rec) && memcmp(rec,expect,sizeof(rec))==0);
+            close(fd);
+        }
+        if(!done)
+        {
+            fdWriteStr(jobErr,"Shard ");
+            fdWriteLong(jobErr,i);
+            fdWriteStr(jobErr," has not completed.\n");
+            missing++;
+        }
+    }
+    if(missing>0)
+    {
+        return -1;
+    }
+    for(int i=0;i<count;i++)
+    {
+        if(buildMarkerPath(markerPath,mode,baseName,i))
+        {
+            unlinkat(jobDir,markerPath,0);
+        }
+    }
+    fdWriteStr(jobOut,"All ");
+    fdWriteLong(jobOut,count);
+    fdWriteStr(jobOut," shards complete.\n");
+    return 0;
+}
+
+//-----------------INCREMENTAL MODE 0------------------
+
+//Fingerprint state kept next to the output as Assignment1/.0_<name>.fp:
+//header {magic, blockSize, inputSize, fpBlock, width, bswap} followed by one 64-bit fingerprint per fpBlock of input
+const long FP_MAGIC=0x32504651;
+
+//Mode 0 with --incremental: fingerprints the input in fpBlock units (a whole number of reversal blocks)
+//and rewrites only the units whose fingerprint differs from the previous run. The output is then
+//truncated/extended to the new input size. Returns 0 on success, -1 on I/O failure.
+//With durable set, the output is synced before the new fingerprints are saved, so saved
+//fingerprints never describe output blocks that could still be lost.
+int runIncremental(int fd_in, int fd_out, Flusher* flusher, const char* fpPath, off_t fileSize, const Transform* tf, bool durable)
+{
+    int blockSize=tf->blockSize;
+    long fpBlock=blockGroup(blockSize);
+
+    //Load the previous fingerprints; they only count if they were taken with the same geometry
+    //and the output still has the size that run left it with
+    long hdr[6]={0,0,0,0,0,0};
+    off_t oldCount=0;
+    unsigned long long* oldHashes=NULL;
+    size_t oldMapLen=0;
+    int fd_fp=openat(jobDir,fpPath,O_RDONLY);
+    if(fd_fp!=-1)
+    {
+        struct stat st_out;
+        if(preadFull(fd_fp,(char*)hdr,sizeof(hdr),0)==(ssize_t)sizeof(hdr)
+           && hdr[0]==FP_MAGIC && hdr[1]==blockSize && hdr[3]==fpBlock && hdr[2]>=0
+           && hdr[4]==tf->width && hdr[5]==tf->bswap
+           && fstat(fd_out,&st_out)==0 && st_out.st_size==hdr[2])
+        {
+            oldCount=(hdr[2]+fpBlock-1)/fpBlock;
+            oldMapLen=oldCount*sizeof(unsigned long long);
+            if(oldCount>0)
+            {
+                oldHashes=(unsigned long long*)mmap(NULL,oldMapLen,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+                if(oldHashes==MAP_FAILED
+                   || preadFull(fd_fp,(char*)oldHashes,oldMapLen,sizeof(hdr))!=(ssize_t)oldMapLen)
+                {
+                    if(oldHashes!=MAP_FAILED)
+                    {
+                        munmap(oldHashes,oldMapLen);
+                    }
+                    oldHashes=NULL;
+                    oldCount=0;
+                }
+            }
+        }
+        close(fd_fp);
+    }
+    //Drop the old state up front: if this run dies midway, the next one falls back to a full rewrite
+    unlinkat(jobDir,fpPath,0);
+    if(oldHashes==NULL)
+    {
+        oldCount=0;
+        if(ftruncate(fd_out,0)==-1)
+        {
+            return -1;
+        }
+        //The truncate released runJob()'s KEEP_SIZE reservation, and a full rewrite is the biggest
+        //write an incremental run makes, so reserve the whole output again
+        if(fileSize>0 && fallocate(fd_out,0,0,fileSize)==-1 && errno!=EOPNOTSUPP && errno!=ENOSYS)
+        {
+            return -1;
+        }
+    }
+
+    off_t newCount=(fileSize+fpBlock-1)/fpBlock;
+    size_t newMapLen=newCount*sizeof(unsigned long long);
+    unsigned long long* newHashes=NULL;
+    if(newCount>0)
+    {
+        newHashes=(unsigned long long*)mmap(NULL,newMapLen,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    }
+    char* buffer=(char*)mmap(NULL,fpBlock,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+
+    //A failed mapping skips the work but still goes through the cleanup at the end, so a --serve
+    //process does not keep whatever did get mapped
+    int status=0;
+    if(newHashes==MAP_FAILED || buffer==MAP_FAILED)
+    {
+        newHashes=(newHashes==MAP_FAILED)?NULL:newHashes;
+        buffer=(buffer==MAP_FAILED)?NULL:buffer;
+        status=-1;
+    }
+    off_t rewritten=0;
+    for(off_t idx=0;status==0 && idx<newCount;idx++)
+    {
+        off_t off=idx*fpBlock;
+        ssize_t sz=fpBlock;
+        if(fileSize-off<fpBlock)
+        {
+            sz=fileSize-off;
+        }
+        DTRACE_PROBE2(q1,read_begin,off,sz);
+        if(preadFull(fd_in,buffer,sz,off)!=sz)
+        {
+            status=-1;
+            break;
+        }
+        DTRACE_PROBE2(q1,read_end,off,sz);
+        newHashes[idx]=fingerprint(buffer,sz);
+        if(idx>=oldCount || oldHashes[idx]!=newHashes[idx])
+        {
+            DTRACE_PROBE2(q1,reverse_begin,off,sz);
+            for(ssize_t b=0;b<sz;b+=blockSize)
+            {
+                reverseElements(buffer+b,(sz-b<blockSize)?sz-b:blockSize,reverseWidth(tf));
+            }
+            DTRACE_PROBE2(q1,reverse_end,off,sz);
+            DTRACE_PROBE2(q1,write_begin,off,sz);
+            if(pwriteFull(fd_out,buffer,sz,off)!=sz)
+            {
+                status=-1;
+                break;
+            }
+            DTRACE_PROBE2(q1,write_end,off,sz);
+            flusherAdd(flusher,off,sz);
+            rewritten++;
+        }
+
+        //Progress
+        write(jobOut,"\rProgress: ",11);
+        fdWriteInt(jobOut,(int)(((idx+1)*100)/newCount));
+        write(jobOut,"%",1);
+    }
+
+    if(status==0 && ftruncate(fd_out,fileSize)==-1)
+    {
+        status=-1;
+    }
+    flusherFinish(flusher);
+    if(status==0 && durable && fdatasync(fd_out)==-1)
+    {
+        status=-1;
+    }
+
+    //Persist the new fingerprints for the next run
+    if(status==0)
+    {
+        fd_fp=openat(jobDir,fpPath,O_CREAT|O_WRONLY|O_TRUNC,0600);
+        hdr[0]=FP_MAGIC;
+        hdr[1]=blockSize;
+        hdr[2]=fileSize;
+        hdr[3]=fpBlock;
+        hdr[4]=tf->width;
+        hdr[5]=tf->bswap;
+        if(fd_fp==-1
+           || pwriteFull(fd_fp,(const char*)hdr,sizeof(hdr),0)!=(ssize_t)sizeof(hdr)
+           || pwriteFull(fd_fp,(const char*)newHashes,newMapLen,sizeof(hdr))!=(ssize_t)newMapLen)
+        {
+            fdWriteStr(jobErr,"\nWarning: could not save fingerprints, next incremental run will be full.\n");
+            unlinkat(jobDir,fpPath,0);
+        }
+        if(fd_fp!=-1)
+        {
+            close(fd_fp);
+        }
+
+        fdWriteStr(jobOut,"\nIncremental: rewrote ");
+        fdWriteLong(jobOut,rewritten);
+        fdWriteStr(jobOut," of ");
+        fdWriteLong(jobOut,newCount);
+        fdWriteStr(jobOut," fingerprint blocks");
+    }
+
+    if(oldHashes!=NULL)
+    {
+        munmap(oldHashes,oldMapLen);
+    }
+    if(newHashes!=NULL)
+    {
+        munmap(newHashes,newMapLen);
+    }
+    if(buffer!=NULL)
+    {
+        munmap(buffer,fpBlock);
+    }
+    return status;
+}
+
+//-----------------JOB BUFFER------------------
+
+//Chunk buffer of each thread. It is kept after the job, so a --serve worker maps it once and only
+//remaps when a job needs a bigger one; a command-line run simply leaves it to process exit.
+thread_local char* warmBuffer=NULL;
+thread_local off_t warmSize=0;
+
+char* jobBuffer(off_t size)
+{
+    if(warmSize<size)
+    {
+        if(warmBuffer!=NULL)
+        {
+            munmap(warmBuffer,warmSize);
+        }
+        warmBuffer=(char*)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        warmSize=size;
+        if(warmBuffer==MAP_FAILED)
+        {
+            warmBuffer=NULL;
+            warmSize=0;
+        }
+    }
+    return warmBuffer;
+}
+
+//-----------------RESULT CACHE------------------
+
+//--cache <dir> keeps finished outputs so a job that was already run is answered by copying its result.
+//An entry is named by a hash of the input's content and the Transform ("<key>.out"). Hashing a large
+//input still costs a full read, so "<identity>.id" files remember the content hash of a file identified
+//by device, inode, size, mtime and ctime: a rerun on an unchanged file skips both the hash and the job.
+//Results are copied out and in with a reflink (FICLONE) where the filesystem supports it, otherwise
+//with copy_file_range. They are never hardlinked, since --incremental and --shard later patch the
+//output in place and would corrupt the entry. Each use touches an entry's mtime, and after a store
+//the oldest entries are removed until the cache fits in --cache-size MiB (LRU).
+//"stats" holds the lookup and hit counts behind the hit rate that every cached run prints.
+const long CACHE_MAGIC=0x31434551;
+const int CACHE_ID_FIELDS=9;
+const off_t CACHE_CHUNK=1024*1024;
+const int CACHE_MAX_ENTRIES=65536;
+
+//Every cache operation opens the directory itself, so no descriptor is held across the job
+struct Cache
+{
+    const char* dir;
+    off_t limit;
+    char idName[32],outName[32];    //outName is empty if the input could not be hashed
+    bool hit;
+    bool byIdentity;                //content hash found through the .id fast path
+    const char* how;                //how the output was copied out or the result stored
+    long lookups,hits;
+};
+
+//"<16 hex digits><suffix>" into dst (32 bytes)
+void cacheName(char* dst, unsigned long long key, const char* suffix)
+{
+    const char* hex="0123456789abcdef";
+    for(int i=0;i<16;i++)
+    {
+        dst[i]=hex[(key>>(60-4*i))&15];
+    }
+    int pos=16;
+    for(int i=0;suffix[i]!='\0';i++)
+    {
+        dst[pos++]=suffix[i];
+    }
+    dst[pos]='\0';
+}
+
+//Hash of a whole file: fingerprints of 1 MiB pieces folded together in order
+bool hashFile(int fd, off_t size, unsigned long long* hash)
+{
+    char* buf=jobBuffer(CACHE_CHUNK);
+    if(buf==NULL)
+    {
+        return false;
+    }
+    unsigned long long h=fingerprint((const char*)&size,sizeof(size));
+    for(off_t off=0;off<size;off+=CACHE_CHUNK)
+    {
+        ssize_t n=(size-off<CACHE_CHUNK)?(ssize_t)(size-off):(ssize_t)CACHE_CHUNK;
+        if(preadFull(fd,buf,n,off)!=n)
+        {
+            return false;
+        }
+        h=(h^fingerprint(buf,n))*0xff51afd7ed558ccdULL;
+        h^=h>>32;
+    }
+    *hash=h;
+    return true;
+}
+
+//Making dst a copy of the first size bytes of src (dst is empty). Returns false on an I/O error.
+bool cloneData(int src, int dst, off_t size, const char** how)
+{
+    if(ioctl(dst,FICLONE,src)==0)
+    {
+        *how="reflink";
+        return true;
+    }
+    *how="copy_file_range";
+    off_t done=0;
+    while(done<size)
+    {
+        loff_t inOff=done,outOff=done;
+        ssize_t n=copy_file_range(src,&inOff,dst,&outOff,size-done,0);
+        if(n<=0)
+        {
+            break;
+        }
+        done+=n;
+    }
+    if(done==size)
+    {
+        return true;
+    }
+    //Kernels or filesystems without copy_file_range: plain copy of the rest
+    *how="read/write";
+    char* buf=jobBuffer(CACHE_CHUNK);
+    if(buf==NULL)
+    {
+        return false;
+    }
+    for(;done<size;)
+    {
+        ssize_t n=(size-done<CACHE_CHUNK)?(ssize_t)(size-done):(ssize_t)CACHE_CHUNK;
+        if(preadFull(src,buf,n,done)!=n || pwriteFull(dst,buf,n,done)!=n)
+        {
+            return false;
+        }
+        done+=n;
+    }
+    return true;
+}
+
+//Adding this lookup (and whether its result was actually used) to the shared counters
+void cacheCount(Cache* c)
+{
+    c->lookups=0;
+    c->hits=0;
+    int dirFd=openat(jobDir,c->dir,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    int fd=(dirFd==-1)?-1:openat(dirFd,"stats",O_CREAT|O_RDWR|O_CLOEXEC,0600);
+    if(dirFd!=-1)
+    {
+        close(dirFd);
+    }
+    if(fd==-1)
+    {
+        return;
+    }
+    flock(fd,LOCK_EX);
+    long counts[2]={0,0};
+    if(preadFull(fd,(char*)counts,sizeof(counts),0)!=(ssize_t)sizeof(counts))
+    {
+        counts[0]=0;
+        counts[1]=0;
+    }
+    counts[0]++;
+    counts[1]+=c->hit?1:0;
+    pwriteFull(fd,(const char*)counts,sizeof(counts),0);
+    close(fd);
+    c->lookups=counts[0];
+    c->hits=counts[1];
+}
+
+//Creating the cache if needed and looking up the result of tf on the input; c->hit says whether an
+//entry exists (cacheFetch() decides whether it is used). Returns false only if the cache directory
+//cannot be used.
+bool cacheLookup(Cache* c, const char* dir, off_t limit, int fd_in, const struct stat* st_in, const Transform* tf)
+{
+    c->dir=dir;
+    c->limit=limit;
+    c->hit=false;
+    c->byIdentity=false;
+    c->how="";
+    c->outName[0]='\0';
+    if(mkdirat(jobDir,dir,0700)==-1 && errno!=EEXIST)
+    {
+        return false;
+    }
+    int dirFd=openat(jobDir,dir,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(dirFd==-1)
+    {
+        return false;
+    }
+
+    //Fast path: an unchanged file whose content hash is already known
+    long id[CACHE_ID_FIELDS]={CACHE_MAGIC,(long)st_in->st_dev,(long)st_in->st_ino,(long)st_in->st_size,
+                              (long)st_in->st_mtim.tv_sec,st_in->st_mtim.tv_nsec,
+                              (long)st_in->st_ctim.tv_sec,st_in->st_ctim.tv_nsec,0};
+    cacheName(c->idName,fingerprint((const char*)id,sizeof(long)*(CACHE_ID_FIELDS-1)),".id");
+    long stored[CACHE_ID_FIELDS];
+    unsigned long long content=0;
+    int fd_id=openat(dirFd,c->idName,O_RDONLY|O_CLOEXEC);
+    if(fd_id!=-1 && preadFull(fd_id,(char*)stored,sizeof(stored),0)==(ssize_t)sizeof(stored)
+       && memcmp(stored,id,sizeof(long)*(CACHE_ID_FIELDS-1))==0)
+    {
+        content=(unsigned long long)stored[CACHE_ID_FIELDS-1];
+        c->byIdentity=true;
+        futimens(fd_id,NULL);
+    }
+    if(fd_id!=-1)
+    {
+        close(fd_id);
+    }
+    if(!c->byIdentity)
+    {
+        if(!hashFile(fd_in,st_in->st_size,&content))
+        {
+            close(dirFd);
+            return true;
+        }
+        id[CACHE_ID_FIELDS-1]=(long)content;
+        fd_id=openat(dirFd,c->idName,O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC,0600);
+        if(fd_id!=-1)
+        {
+            pwriteFull(fd_id,(const char*)id,sizeof(id),0);
+            close(fd_id);
+        }
+    }
+
+    //The result: content hash plus everything that shapes the output
+    long key[8]={(long)content,tf->mode,tf->blockSize,(long)tf->start,(long)tf->end,tf->width,tf->bswap?1:0,(long)st_in->st_size};
+    cacheName(c->outName,fingerprint((const char*)key,sizeof(key)),".out");
+    struct stat st;
+    c->hit=(fstatat(dirFd,c->outName,&st,0)==0 && S_ISREG(st.st_mode) && st.st_size==st_in->st_size);
+    close(dirFd);
+    return true;
+}
+
+//Copying a hit out to the (empty) output. Returns false if the entry is gone or unreadable, in which
+//case the job simply runs as a miss.
+bool cacheFetch(Cache* c, int fd_out, off_t size)
+{
+    int dirFd=openat(jobDir,c->dir,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    int fd=(dirFd==-1)?-1:openat(dirFd,c->outName,O_RDONLY|O_CLOEXEC);
+    struct stat st;
+    bool ok=(fd!=-1 && fstat(fd,&st)==0 && st.st_size==size && cloneData(fd,fd_out,size,&c->how));
+    if(ok)
+    {
+        futimens(fd,NULL);
+    }
+    if(fd!=-1)
+    {
+        close(fd);
+    }
+    if(dirFd!=-1)
+    {
+        close(dirFd);
+    }
+    c->hit=ok;
+    return ok;
+}
+
+//Removing least recently used entries until the cache fits its limit
+void cacheEvict(Cache* c, int dirFd)
+{
+    int fd=openat(dirFd,".",O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    DIR* d=(fd==-1)?NULL:fdopendir(fd);
+    if(d==NULL)
+    {
+        if(fd!=-1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    char (*names)[32]=new char[CACHE_MAX_ENTRIES][32];
+    off_t* sizes=new off_t[CACHE_MAX_ENTRIES];
+    long long* used=new long long[CACHE_MAX_ENTRIES];
+    int count=0;
+    off_t total=0;
+    struct dirent* e;
+    struct stat st;
+    while((e=readdir(d))!=NULL && count<CACHE_MAX_ENTRIES)
+    {
+        int len=strLength(e->d_name);
+        if(!(len==19 && strEqual(e->d_name+16,".id")) && !(len==20 && strEqual(e->d_name+16,".out")))
+        {
+            continue; //stats, temporary files and anything else that is not an entry
+        }
+        if(fstatat(dirFd,e->d_name,&st,AT_SYMLINK_NOFOLLOW)==0 && S_ISREG(st.st_mode))
+        {
+            memcpy(names[count],e->d_name,len+1);
+            sizes[count]=st.st_blocks*512;
+            used[count]=(long long)st.st_mtim.tv_sec*1000000000LL+st.st_mtim.tv_nsec;
+            total+=sizes[count];
+            count++;
+        }
+    }
+    closedir(d);
+    while(total>c->limit && count>0)
+    {
+        int oldest=0;
+        for(int i=1;i<count;i++)
+        {
+            if(used[i]<used[oldest])
+            {
+                oldest=i;
+            }
+        }
+        unlinkat(dirFd,names[oldest],0);
+        total-=sizes[oldest];
+        count--;
+        memcpy(names[oldest],names[count],32);
+        sizes[oldest]=sizes[count];
+        used[oldest]=used[count];
+    }
+    delete[] names;
+    delete[] sizes;
+    delete[] used;
+}
+
+//Keeping a freshly produced output (fd_out, readable) as the entry for this lookup
+void cacheStore(Cache* c, int fd_out, off_t size)
+{
+    if(c->outName[0]=='\0' || size>c->limit)
+    {
+        c->how="not stored";
+        return;
+    }
+    //Written under a temporary name and renamed, so readers never see a partial entry
+    char tmpName[48];
+    int len=longToStr(tmpName,getpid());
+    tmpName[len++]='.';
+    len+=longToStr(tmpName+len,nowNs());
+    memcpy(tmpName+len,".tmp",5);
+    int dirFd=openat(jobDir,c->dir,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    int fd=(dirFd==-1)?-1:openat(dirFd,tmpName,O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC,0600);
+    bool ok=(fd!=-1 && cloneData(fd_out,fd,size,&c->how));
+    if(fd!=-1 && close(fd)==-1)
+    {
+        ok=false;
+    }
+    if(fd!=-1 && (!ok || renameat(dirFd,tmpName,dirFd,c->outName)==-1))
+    {
+        unlinkat(dirFd,tmpName,0);
+        ok=false;
+    }
+    if(ok)
+    {
+        cacheEvict(c,dirFd);
+    }
+    else
+    {
+        c->how="not stored";
+    }
+    if(dirFd!=-1)
+    {
+        close(dirFd);
+    }
+}
+
+//"Result cache: hit (same file, reflink); 3 of 4 lookups hit (75%)"
+void cacheReport(const Cache* c)
+{
+    fdWriteStr(jobOut,"Result cache: ");
+    if(c->hit)
+    {
+        fdWriteStr(jobOut,c->byIdentity?"hit (same file, ":"hit (same content, ");
+    }
+    else
+    {
+        fdWriteStr(jobOut,"miss (result ");
+        fdWriteStr(jobOut,c->how[0]=='n'?"":"stored by ");
+    }
+    fdWriteStr(jobOut,c->how);
+    fdWriteStr(jobOut,"); ");
+    fdWriteLong(jobOut,c->hits);
+    fdWriteStr(jobOut," of ");
+    fdWriteLong(jobOut,c->lookups);
+    fdWriteStr(jobOut," lookups hit (");
+    fdWriteLong(jobOut,c->lookups>0?c->hits*100/c->lookups:0);
+    fdWriteStr(jobOut,"%)\n");
+}
+
+//-----------------MAIN------------------
+
+//Runs one q1 command line and returns its exit status. Everything it prints goes to jobOut/jobErr
+//and every path is resolved against jobDir, so --serve workers can run jobs side by side.
+int runJob(int argc, char* argv[])
+{
+    //Separate --options from positional arguments
+    char* args[8];
+    int nargs=0;
+    bool incremental=false,durable=false,bswap=false;
+    int width=1;
+    int shardIndex=0,shardCount=0,finalizeCount=0,fixedChunk=0,fixedTile=0;
+    const char* cacheDir=NULL;
+    int cacheSizeMb=1024;
+    for(int i=0;i<argc;i++)
+    {
+        if(i>0 && argv[i][0]=='-' && argv[i][1]=='-')
+        {
+            if(strEqual(argv[i],"--shard") && i+1<argc)
+            {
+                if(!parseShard(argv[++i],&shardIndex,&shardCount))
+                {
+                    fdWriteStr(jobErr,"Invalid shard, expected <i>/<N> with 0 <= i < N.\n");
+                    return 1;
+                }
+            }
+            else if(strEqual(argv[i],"--finalize") && i+1<argc)
+            {
+                finalizeCount=convertToInt(argv[++i]);
+                if(finalizeCount<=0 || finalizeCount>65536)
+                {
+                    fdWriteStr(jobErr,"Invalid shard count for --finalize.\n");
+                    return 1;
+                }
+            }
+            else if((strEqual(argv[i],"--chunk") || strEqual(argv[i],"--tile")) && i+1<argc)
+            {
+                int v=convertToInt(argv[i+1]);
+                if(v<=0 || v>256*1024*1024)
+                {
+                    fdWriteStr(jobErr,"Invalid chunk/tile size.\n");
+                    return 1;
+                }
+                if(strEqual(argv[i],"--chunk"))
+                {
+                    fixedChunk=v;
+                }
+                else
+                {
+                    fixedTile=v;
+                }
+                i++;
+            }
+            else if(strEqual(argv[i],"--width") && i+1<argc)
+            {
+                width=convertToInt(argv[++i]);
+                if(!validWidth(width))
+                {
+                    fdWriteStr(jobErr,"Element width must be 1, 2, 4, 8 or 16.\n");
+                    return 1;
+                }
+            }
+            else if(strEqual(argv[i],"--bswap"))
+            {
+                bswap=true;
+            }
+            else if(strEqual(argv[i],"--incremental"))
+            {
+                incremental=true;
+            }
+            else if(strEqual(argv[i],"--durable"))
+            {
+                durable=true;
+            }
+            else if(strEqual(argv[i],"--cache") && i+1<argc)
+            {
+                cacheDir=argv[++i];
+            }
+            else if(strEqual(argv[i],"--cache-size") && i+1<argc)
+            {
+                cacheSizeMb=convertToInt(argv[++i]);
+                if(cacheSizeMb<=0)
+                {
+                    fdWriteStr(jobErr,"Invalid cache size.\n");
+                    return 1;
+                }
+            }
+            else
+            {
+                fdWriteStr(jobErr,"Unknown option: ");
+                fdWriteStr(jobErr,argv[i]);
+                fdWriteStr(jobErr,"\n");
+                printUsage();
+                return 1;
+            }
+        }
+        else if(nargs<8)
+        {
+            args[nargs++]=argv[i];
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+    argc=nargs;
+    argv=args;
+
+    if(argc<3)
+    {
+        printUsage();
+        return 1;
+    }
+
+    const char* inputFile=argv[1];
+    int mode=convertToInt(argv[2]);
+
+    //Validating args per mode
+    int blockSize=0,start=0,end=0;
+    if(mode==0)
+    {
+        if(argc!=4)
+        {
+            fdWriteStr(jobErr,"Flag 0 requires block size.\n");
+            printUsage();
+            return 1;
+        }
+        blockSize=convertToInt(argv[3]);
+        if(blockSize<=0)
+        {
+            fdWriteStr(jobErr,"Invalid block size.\n");
+            return 1;
+        }
+        if(blockSize>8*1024*1024)
+        {
+            fdWriteStr(jobErr,"Warning: block > *MB.\n");
+            return 1;
+        }
+    }
+    else if(mode==1)
+    {
+        if(argc!=3)
+        {
+            fdWriteStr(jobErr,"Flag 1 takes no extra args.\n");
+            printUsage();
+            return 1;
+        } 
+        blockSize = 1024*1024;
+    }
+    else if(mode==2)
+    {
+        if (argc!=5)
+        {
+            fdWriteStr(jobErr,"Flag 2 requires start and end indices.\n");
+            printUsage();
+            return 1;
+        }
+        start=convertToInt(argv[3]);
+        end=convertToInt(argv[4]);
+        if(start<0 || end<0 || start>=end)
+        {
+            fdWriteStr(jobErr,"Invalid start/end indices.\n");
+            return 1;
+        }
+        blockSize=1024*1024; //chunk size for revresed parts
+    }
+    else
+    {
+        fdWriteStr(jobErr,"Only flags 0, 1, 2 supported.\n");
+        return 1;
+    }
+    if(mode==0 && blockSize%width!=0)
+    {
+        fdWriteStr(jobErr,"Block size must be a multiple of the element width.\n");
+        return 1;
+    }
+    //Chunks and tiles must hold whole elements
+    if(fixedChunk>0)
+    {
+        fixedChunk=(fixedChunk<width)?width:fixedChunk-fixedChunk%width;
+    }
+    if(fixedTile>0)
+    {
+        fixedTile=(fixedTile<width)?width:fixedTile-fixedTile%width;
+    }
+    if((fixedChunk>0 || fixedTile>0) && mode==0)
+    {
+        fdWriteStr(jobErr,"--chunk and --tile apply to flags 1 and 2 (flag 0 works in whole blocks).\n");
+        return 1;
+    }
+    if(incremental && mode!=0)
+    {
+        fdWriteStr(jobErr,"--incremental is only supported with flag 0.\n");
+        return 1;
+    }
+    if((incremental && (shardCount>0 || finalizeCount>0)) || (shardCount>0 && finalizeCount>0))
+    {
+        fdWriteStr(jobErr,"--incremental, --shard and --finalize cannot be combined.\n");
+        return 1;
+    }
+    if(cacheDir!=NULL && (incremental || shardCount>0 || finalizeCount>0))
+    {
+        fdWriteStr(jobErr,"--cache only applies to full runs (not --incremental, --shard or --finalize).\n");
+        return 1;
+    }
+    
+    //Ensure Assignment1 directory
+    if(mkdirat(jobDir,"Assignment1",0700)==-1 && errno!=EEXIST)
+    {
+        fdWriteStr(jobErr,"Assignment1 dirctory creation failed!\n");
+        return 1;
+    }
+
+    //Open input (unless the client of a --serve daemon already did)
+    int fd_in=(jobInput>=0)?jobInput:openat(jobDir,inputFile,O_RDONLY);
+    jobInput=-1;
+    if(fd_in==-1)
+    {
+        fdWriteStr(jobErr,"Failed to open input!\n");
+        return 1;
+    }
+
+    //Build output path: Assignment1/<flag>_<input_file_name>
+    const char* baseName=inputFile;
+    for(int i=0;inputFile[i]!='\0';i++)
+    {
+        if(inputFile[i]=='/')
+        {
+            baseName=inputFile+i+1;
+        }
+    }
+    char outputPath[512],fpPath[512];
+    if(!buildOutputPath(outputPath,"",mode,baseName,"") || !buildOutputPath(fpPath,".",mode,baseName,".fp"))
+    {
+        fdWriteStr(jobErr,"Output path too long!\n");
+        close(fd_in);
+        return 1;
+    }
+
+    //Get file size
+    struct stat st_in;
+    if(fstat(fd_in,&st_in)==-1)
+    {
+        fdWriteStr(jobErr,"Failed to get file size!\n");
+        close(fd_in);
+        return 1;
+    }
+    off_t fileSize=st_in.st_size;
+
+    if(mode==2 && (start>=fileSize || end>=fileSize || start>=end))
+    {
+        fdWriteStr(jobErr,"Start/end indices out of range!\n");
+        close(fd_in);
+        return 1;
+    }
+    if(fileSize%width!=0 || (mode==2 && (start%width!=0 || (end+1)%width!=0)))
+    {
+        fdWriteStr(jobErr,"File size and start/end+1 must be multiples of the element width.\n");
+        close(fd_in);
+        return 1;
+    }
+    Transform tf={mode,blockSize,start,end,width,bswap};
+
+    if(finalizeCount>0)
+    {
+        int status=runFinalize(&tf,&st_in,baseName,finalizeCount);
+        close(fd_in);
+        return status==0?0:1;
+    }
+
+    //This process's share of the output: everything, or the range owned by its shard
+    off_t lo=0,hi=fileSize;
+    char markerPath[512];
+    if(shardCount>0)
+    {
+        shardRange(fileSize,shardIndex,shardCount,shardAlign(&tf),&lo,&hi);
+        if(!buildMarkerPath(markerPath,mode,baseName,shardIndex))
+        {
+            fdWriteStr(jobErr,"Output path too long!\n");
+            close(fd_in);
+            return 1;
+        }
+        unlinkat(jobDir,markerPath,0);
+    }
+
+    //Result cache: a hit is copied into the output below instead of being produced
+    Cache cache;
+    if(cacheDir!=NULL && !cacheLookup(&cache,cacheDir,(off_t)cacheSizeMb*1024*1024,fd_in,&st_in,&tf))
+    {
+        fdWriteStr(jobErr,"Failed to open result cache!\n");
+        close(fd_in);
+        return 1;
+    }
+    bool cacheHit=(cacheDir!=NULL && cache.hit);
+
+    //Open output (readable as well when a cache may copy from it)
+    //(incremental runs patch the previous output in place, and shards share it, so neither truncates here)
+    int fd_out=openat(jobDir,outputPath,O_CREAT|(cacheDir!=NULL?O_RDWR:O_WRONLY)|((incremental || shardCount>0)?0:O_TRUNC),0600);
+    if(fd_out==-1)
+    {
+        fdWriteStr(jobErr,"Failed to open output\n");
+        close(fd_in);
+        return 1;
+    }
+    //Every shard sizes the shared output identically, so the order in which they start does not matter
+    if(shardCount>0 && ftruncate(fd_out,fileSize)==-1)
+    {
+        fdWriteStr(jobErr,"Failed to size output!\n");
+        close(fd_in);
+        close(fd_out);
+        return 1;
+    }
+
+    //A cache hit is copied out now, before the chunk buffer below is taken: cloneData() may remap this
+    //thread's buffer. Only a copy that succeeded counts as a hit; otherwise the job runs as a miss.
+    if(cacheDir!=NULL)
+    {
+        cacheHit=(cacheHit && cacheFetch(&cache,fd_out,fileSize));
+        cacheCount(&cache);
+    }
+
+    //Reserve the output's blocks up front so writeback never stalls on allocation or hits ENOSPC
+    //midway. Incremental runs keep the old size: runIncremental() decides whether it is still valid.
+    if(hi>lo && !cacheHit && fallocate(fd_out,incremental?FALLOC_FL_KEEP_SIZE:0,lo,hi-lo)==-1
+       && errno!=EOPNOTSUPP && errno!=ENOSYS)
+    {
+        fdWriteStr(jobErr,"Failed to preallocate output!\n");
+        close(fd_in);
+        close(fd_out);
+        return 1;
+    }
+    Flusher flusher;
+    flusherInit(&flusher,fd_out);
+
+    //Map buffer for chunk operations (big enough for the largest chunk the tuner may pick)
+    Tuner tuner;
+    if(mode==0)
+    {
+        tunerFixed(&tuner,blockGroup(blockSize),blockGroup(blockSize));
+    }
+    else
+    {
+        tunerInit(&tuner,fd_in,fd_out,fixedChunk,fixedTile);
+    }
+    char* buffer=jobBuffer(tuner.maxChunk);
+    if(buffer==NULL)
+    {
+        fdWriteStr(jobErr,"Buffer allocation failed!\n");
+        close(fd_in);
+        close(fd_out);
+        return 1;
+    }
+
+    //-----------------------FLAG IMPLEMENTATIONS-------------------------
+    int status;
+    if(incremental) //Block-wise reversal of changed blocks only
+    {
+        status=runIncremental(fd_in,fd_out,&flusher,fpPath,fileSize,&tf,durable);
+    }
+    else
+    {
+        //A full flag 0 rewrite invalidates fingerprints kept by earlier --incremental runs
+        if(mode==0)
+        {
+            unlinkat(jobDir,fpPath,0);
+        }
+        status=cacheHit?0:processRange(fd_in,fd_out,&flusher,buffer,&tuner,&tf,fileSize,lo,hi);
+    }
+    if(status==-1)
+    {
+        fdWriteStr(jobErr,"\nI/O error while processing!\n");
+        close(fd_in);
+        close(fd_out);
+        return 1;
+    }
+    flusherFinish(&flusher);
+    if(!cacheHit)
+    {
+        write(jobOut,"\n",1);
+    }
+    if(mode!=0 && !cacheHit)
+    {
+        tunerReport(&tuner);
+    }
+    if(cacheDir!=NULL)
+    {
+        if(!cacheHit)
+        {
+            cacheStore(&cache,fd_out,fileSize);
+        }
+        cacheReport(&cache);
+    }
+    close(fd_in);
+
+    //--durable: the job only reports success once the data and the directory entry are on stable storage.
+    //Shards always sync before recording completion.
+    if(durable || shardCount>0)
+    {
+        int fd_dir=openat(jobDir,"Assignment1",O_RDONLY|O_DIRECTORY);
+        if(fdatasync(fd_out)==-1 || fd_dir==-1 || fsync(fd_dir)==-1)
+        {
+            fdWriteStr(jobErr,"Failed to make output durable!\n");
+            if(fd_dir!=-1)
+            {
+                close(fd_dir);
+            }
+            close(fd_out);
+            return 1;
+        }
+        close(fd_dir);
+    }
+    if(close(fd_out)==-1)
+    {
+        fdWriteStr(jobErr,"Failed to close output!\n");
+        return 1;
+    }
+    if(durable)
+    {
+        fdWriteStr(jobOut,"Output is durable on disk.\n");
+    }
+
+    //A shard's record is only written once its range is on stable storage, so --finalize never
+    //reports a range that a crash could still lose
+    if(shardCount>0)
+    {
+        long rec[SHARD_FIELDS];
+        fillShardRecord(rec,&tf,&st_in,shardCount,shardIndex,lo,hi);
+        int fd_mark=openat(jobDir,markerPath,O_CREAT|O_WRONLY|O_TRUNC,0600);
+        if(fd_mark==-1 || pwriteFull(fd_mark,(const char*)rec,sizeof(rec),0)!=(ssize_t)sizeof(rec) || fdatasync(fd_mark)==-1)
+        {
+            fdWriteStr(jobErr,"Failed to record shard completion!\n");
+            if(fd_mark!=-1)
+            {
+                close(fd_mark);
+            }
+            return 1;
+        }
+        close(fd_mark);
+        fdWriteStr(jobOut,"Shard ");
+        fdWriteLong(jobOut,shardIndex);
+        fdWriteStr(jobOut," of ");
+        fdWriteLong(jobOut,shardCount);
+        fdWriteStr(jobOut," complete: bytes ");
+        fdWriteLong(jobOut,lo);
+        fdWriteStr(jobOut,"-");
+        fdWriteLong(jobOut,hi);
+        fdWriteStr(jobOut,"\n");
+    }
+    return 0;
+}
+
+//-----------------JOB SERVER------------------
+
+//--serve <socket> keeps q1 resident: a listener thread accepts clients on a SOCK_SEQPACKET Unix socket
+//and queues them, and a fixed pool of workers (each with its warm chunk buffer) runs their jobs.
+//Exchange with a client (--connect <socket> ...):
+//  1. server -> client: JobReply with SERVE_QUEUED and its place in the queue, or SERVE_BUSY when the
+//     queue already holds --queue jobs (admission control; the client gives up instead of waiting)
+//  2. client -> server: SERVE_MAGIC followed by the job's arguments, NUL-separated, with SCM_RIGHTS
+//     carrying its working directory, stdout, stderr and, when it could open it, the input file
+//  3. server -> client: JobReply with the job's exit status and timings
+//The job runs against the passed descriptors, so progress and results appear on the client's terminal
+//exactly as for a local run and outputs land in the client's Assignment1 directory.
+const long SERVE_MAGIC=0x31565253;
+const long SERVE_BUSY=75;           //reply status (and client exit status) when the queue is full
+const long SERVE_QUEUED=-1;         //first reply to an admitted client
+const int SERVE_MAX_REQUEST=4096;
+const int SERVE_MAX_ARGS=16;
+const int SERVE_MAX_FDS=4;
+
+struct JobReply
+{
+    long magic;
+    long status;        //job exit status, SERVE_QUEUED or SERVE_BUSY
+    long queuedNs;      //time between accept and a worker picking the job up
+    long runNs;         //time spent in the job
+    long queueDepth;    //jobs waiting (ahead of it when queued, behind it when it started)
+};
+
+struct JobQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int* conns;
+    long long* acceptedAt;
+    int capacity,head,count;
+};
+
+//Sending the closing reply; MSG_NOSIGNAL so a client that went away cannot kill the server
+void sendReply(int conn, long status, long queuedNs, long runNs, long queueDepth)
+{
+    JobReply reply={SERVE_MAGIC,status,queuedNs,runNs,queueDepth};
+    send(conn,&reply,sizeof(reply),MSG_NOSIGNAL);
+}
+
+//Receiving one request and running it on this thread. Returns the job's exit status
+//(1 for a malformed request).
+int serveConnection(int conn, long long acceptedAt, long queueDepth)
+{
+    char request[SERVE_MAX_REQUEST+1];
+    char control[CMSG_SPACE(SERVE_MAX_FDS*sizeof(int))];
+    struct iovec iov={request,SERVE_MAX_REQUEST};
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control;
+    msg.msg_controllen=sizeof(control);
+    ssize_t len=recvmsg(conn,&msg,MSG_CMSG_CLOEXEC);
+    long long startedAt=nowNs();
+
+    int fds[SERVE_MAX_FDS];
+    int nfds=0;
+    for(struct cmsghdr* c=CMSG_FIRSTHDR(&msg);c!=NULL;c=CMSG_NXTHDR(&msg,c))
+    {
+        if(c->cmsg_level==SOL_SOCKET && c->cmsg_type==SCM_RIGHTS)
+        {
+            int n=(int)((c->cmsg_len-CMSG_LEN(0))/sizeof(int));
+            for(int k=0;k<n && nfds<SERVE_MAX_FDS;k++)
+            {
+                memcpy(&fds[nfds++],CMSG_DATA(c)+k*sizeof(int),sizeof(int));
+            }
+        }
+    }
+
+    //Splitting the NUL-separated arguments; argv[0] is only a name, as for a local run
+    char* args[SERVE_MAX_ARGS+1];
+    int nargs=0;
+    args[nargs++]=(char*)"q1";
+    long magic=0;
+    bool valid=(len>=(ssize_t)sizeof(long) && !(msg.msg_flags&(MSG_TRUNC|MSG_CTRUNC)) && nfds>=3);
+    if(valid)
+    {
+        memcpy(&magic,request,sizeof(long));
+        request[len]='\0';
+        valid=(magic==SERVE_MAGIC);
+        for(ssize_t pos=sizeof(long);valid && pos<len;)
+        {
+            if(nargs==SERVE_MAX_ARGS)
+            {
+                valid=false;
+                break;
+            }
+            args[nargs++]=request+pos;
+            pos+=strLength(request+pos)+1;
+        }
+    }
+
+    int status=1;
+    if(valid)
+    {
+        jobDir=fds[0];
+        jobOut=fds[1];
+        jobErr=fds[2];
+        jobInput=(nfds>3)?fds[3]:-1;
+        status=runJob(nargs,args);
+        if(jobInput>=0)
+        {
+            close(jobInput);
+        }
+        jobDir=AT_FDCWD;
+        jobOut=1;
+        jobErr=2;
+        jobInput=-1;
+        for(int k=0;k<3;k++)
+        {
+            close(fds[k]);
+        }
+    }
+    else
+    {
+        for(int k=0;k<nfds;k++)
+        {
+            close(fds[k]);
+        }
+    }
+    sendReply(conn,status,(long)(startedAt-acceptedAt),(long)(nowNs()-startedAt),queueDepth);
+    close(conn);
+    return status;
+}
+
+void* serveWorker(void* arg)
+{
+    JobQueue* q=(JobQueue*)arg;
+    while(true)
+    {
+        pthread_mutex_lock(&q->lock);
+        while(q->count==0)
+        {
+            pthread_cond_wait(&q->ready,&q->lock);
+        }
+        int conn=q->conns[q->head];
+        long long acceptedAt=q->acceptedAt[q->head];
+        q->head=(q->head+1)%q->capacity;
+        q->count--;
+        long depth=q->count;
+        pthread_mutex_unlock(&q->lock);
+        serveConnection(conn,acceptedAt,depth);
+    }
+    return NULL;
+}
+
+//q1 --serve <socket> [--workers N] [--queue N]; only returns on a setup error
+int runServer(int argc, char* argv[])
+{
+    const char* socketPath=argv[2];
+    long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+    int workers=(cpus>0 && cpus<64)?(int)cpus:(cpus>0?64:1);
+    int capacity=64;
+    for(int i=3;i<argc;i++)
+    {
+        int v=(i+1<argc)?convertToInt(argv[i+1]):-1;
+        if(strEqual(argv[i],"--workers") && v>0 && v<=1024)
+        {
+            workers=v;
+        }
+        else if(strEqual(argv[i],"--queue") && v>0 && v<=65536)
+        {
+            capacity=v;
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+        i++;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if(strLength(socketPath)>=(int)sizeof(addr.sun_path))
+    {
+        fdWriteStr(2,"Socket path too long!\n");
+        return 1;
+    }
+    memcpy(addr.sun_path,socketPath,strLength(socketPath)+1);
+
+    //A socket left behind by a previous server is replaced; anything else at that path is not touched
+    struct stat st;
+    if(lstat(socketPath,&st)==0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(socketPath);
+    }
+    //Only the owner may connect: jobs run with the server's rights on the directories clients pass in
+    mode_t oldMask=umask(0077);
+    int fd_listen=socket(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0);
+    int bound=(fd_listen==-1)?-1:bind(fd_listen,(struct sockaddr*)&addr,sizeof(addr));
+    umask(oldMask);
+    if(bound==-1 || listen(fd_listen,capacity)==-1)
+    {
+        fdWriteStr(2,"Failed to listen on socket!\n");
+        return 1;
+    }
+    signal(SIGPIPE,SIG_IGN);
+
+    JobQueue q;
+    pthread_mutex_init(&q.lock,NULL);
+    pthread_cond_init(&q.ready,NULL);
+    q.conns=new int[capacity];
+    q.acceptedAt=new long long[capacity];
+    q.capacity=capacity;
+    q.head=0;
+    q.count=0;
+    for(int k=0;k<workers;k++)
+    {
+        pthread_t tid;
+        if(pthread_create(&tid,NULL,serveWorker,&q)!=0)
+        {
+            fdWriteStr(2,"Failed to start worker threads!\n");
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    fdWriteStr(1,"Serving on ");
+    fdWriteStr(1,socketPath);
+    fdWriteStr(1," with ");
+    fdWriteLong(1,workers);
+    fdWriteStr(1," workers, queue depth ");
+    fdWriteLong(1,capacity);
+    fdWriteStr(1,"\n");
+
+    while(true)
+    {
+        int conn=accept4(fd_listen,NULL,NULL,SOCK_CLOEXEC);
+        if(conn==-1)
+        {
+            continue;
+        }
+        long long acceptedAt=nowNs();
+        //A client that connects but never sends its request must not hold a worker forever
+        struct timeval timeout={5,0};
+        setsockopt(conn,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+        //The verdict goes out before the job is queued: the client only sends its request once admitted,
+        //and a rejected one is closed before it sent anything. Only this thread adds jobs, so the
+        //space seen here is still there below.
+        pthread_mutex_lock(&q.lock);
+        long ahead=q.count;
+        pthread_mutex_unlock(&q.lock);
+        if(ahead==q.capacity)
+        {
+            sendReply(conn,SERVE_BUSY,0,0,capacity);
+            close(conn);
+            continue;
+        }
+        sendReply(conn,SERVE_QUEUED,0,0,ahead);
+        pthread_mutex_lock(&q.lock);
+        int slot=(q.head+q.count)%q.capacity;
+        q.conns[slot]=conn;
+        q.acceptedAt[slot]=acceptedAt;
+        q.count++;
+        pthread_cond_signal(&q.ready);
+        pthread_mutex_unlock(&q.lock);
+    }
+    return 0;
+}
+
+//q1 --connect <socket> <input_file> <flag> [args] [options]: runs the job on a --serve daemon and
+//exits with its status (SERVE_BUSY if the daemon turned it away)
+int runClient(int argc, char* argv[])
+{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if(argc<5 || strLength(argv[2])>=(int)sizeof(addr.sun_path))
+    {
+        printUsage();
+        return 1;
+    }
+    memcpy(addr.sun_path,argv[2],strLength(argv[2])+1);
+
+    char request[SERVE_MAX_REQUEST];
+    memcpy(request,&SERVE_MAGIC,sizeof(long));
+    int len=sizeof(long);
+    for(int i=3;i<argc;i++)
+    {
+        int n=strLength(argv[i])+1;
+        if(len+n>SERVE_MAX_REQUEST || i-3>=SERVE_MAX_ARGS-1)
+        {
+            fdWriteStr(2,"Too many or too long arguments for the server!\n");
+            return 1;
+        }
+        memcpy(request+len,argv[i],n);
+        len+=n;
+    }
+
+    int fd_sock=socket(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0);
+    if(fd_sock==-1 || connect(fd_sock,(struct sockaddr*)&addr,sizeof(addr))==-1)
+    {
+        fdWriteStr(2,"Failed to connect to server!\n");
+        return 1;
+    }
+    //Working directory, stdout, stderr and the input; an input we cannot open is left to the
+    //server, which then reports the error the usual way
+    int fds[SERVE_MAX_FDS]={open(".",O_RDONLY|O_DIRECTORY|O_CLOEXEC),1,2,open(argv[3],O_RDONLY|O_CLOEXEC)};
+    int nfds=(fds[3]==-1)?3:4;
+    if(fds[0]==-1)
+    {
+        fdWriteStr(2,"Failed to open working directory!\n");
+        return 1;
+    }
+    char control[CMSG_SPACE(SERVE_MAX_FDS*sizeof(int))];
+    memset(control,0,sizeof(control));
+    struct iovec iov={request,(size_t)len};
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control;
+    msg.msg_controllen=CMSG_SPACE(nfds*sizeof(int));
+    struct cmsghdr* c=CMSG_FIRSTHDR(&msg);
+    c->cmsg_level=SOL_SOCKET;
+    c->cmsg_type=SCM_RIGHTS;
+    c->cmsg_len=CMSG_LEN(nfds*sizeof(int));
+    memcpy(CMSG_DATA(c),fds,nfds*sizeof(int));
+
+    JobReply reply;
+    if(recv(fd_sock,&reply,sizeof(reply),0)!=(ssize_t)sizeof(reply) || reply.magic!=SERVE_MAGIC)
+    {
+        fdWriteStr(2,"Server connection failed!\n");
+        return 1;
+    }
+    if(reply.status==SERVE_BUSY)
+    {
+        fdWriteStr(2,"Server busy (queue of ");
+        fdWriteLong(2,reply.queueDepth);
+        fdWriteStr(2," jobs full), try again later.\n");
+        return (int)SERVE_BUSY;
+    }
+    if(sendmsg(fd_sock,&msg,MSG_NOSIGNAL)!=len || recv(fd_sock,&reply,sizeof(reply),0)!=(ssize_t)sizeof(reply)
+       || reply.magic!=SERVE_MAGIC)
+    {
+        fdWriteStr(2,"Server connection failed!\n");
+        return 1;
+    }
+    close(fd_sock);
+    fdWriteStr(1,"Served: queued ");
+    fdWriteLong(1,reply.queuedNs/1000);
+    fdWriteStr(1," us, ran ");
+    fdWriteLong(1,reply.runNs/1000);
+    fdWriteStr(1," us, ");
+    fdWriteLong(1,reply.queueDepth);
+    fdWriteStr(1," jobs waiting behind it\n");
+    return (int)reply.status;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc>=3 && strEqual(argv[1],"--serve"))
+    {
+        return runServer(argc,argv);
+    }
+    if(argc>=3 && strEqual(argv[1],"--connect"))
+    {
+        return runClient(argc,argv);
+    }
+    return runJob(argc,argv);
 }
\ No newline at end of file
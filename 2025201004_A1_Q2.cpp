@@ -1,8 +1,29 @@
-#include <unistd.h> // read, write, lseek, close, _exit
+#include <unistd.h> // read, write, lseek, sysconf, close, _exit
 #include <fcntl.h> // open
 #include <sys/stat.h> // stat, fstat, file permission macros
-#include <sys/mman.h>  // mmap, munmap
+#include <sys/mman.h>  // mmap, munmap, madvise
 #include <sys/types.h> // off_t
+#include <string.h> // memcmp, memcpy
+#include <time.h> // clock_gettime
+#include <math.h> // pow
+
+// USDT static probes (see q1): compare_begin/compare_end around each compared block, window or sample
+// (new-file offset, size),
+// part (flag 2 part 0/1/2 for A/B/C, offset, length) and mismatch (new-file offset, size of the failing window).
+// They are NOPs until a tracer attaches, and compile away without <sys/sdt.h> or with -DNO_SDT.
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+#ifndef HAVE_SDT
+#define DTRACE_PROBE2(provider,name,a,b) do { (void)(a); (void)(b); } while(0)
+#define DTRACE_PROBE3(provider,name,a,b,c) do { (void)(a); (void)(b); (void)(c); } while(0)
+#endif
+#if defined(__SSSE3__)
+#include <immintrin.h> // SSE/AVX intrinsics for the reverse-compare kernel
+#endif
 
 //------------UTILITY FUNCTIONS------------
 
@@ -57,19 +78,399 @@ long convertToLong(const char* str)
     return value;
 }
 
-// Checking if buffer a[] is the reverse of buffer b[] for n bytes
+// Comparing two strings for equality
+int strEqual(const char* a, const char* b)
+{
+    int i=0;
+    while(a[i] && a[i]==b[i])
+    {
+        i++;
+    }
+    return a[i]==b[i];
+}
+
+// Writing a non-negative 64-bit value (offsets, byte counts) to a file descriptor
+void fdWriteLong(int fd, long num)
+{
+    char buffer[20];
+    int i=20;
+    do
+    {
+        buffer[--i]='0'+(num%10);
+        num/=10;
+    } while(num>0 && i>0);
+    write(fd,buffer+i,20-i);
+}
+
+// Parsing "<i>/<N>" for --shard; returns 0 unless 0 <= i < N <= 65536
+int parseShard(const char* str, long* index, long* count)
+{
+    char part[20];
+    int i=0;
+    while(str[i] && str[i]!='/' && i<19)
+    {
+        part[i]=str[i];
+        i++;
+    }
+    if(str[i]!='/' || i==0)
+    {
+        return 0;
+    }
+    part[i]='\0';
+    *index=convertToLong(part);
+    *count=convertToLong(str+i+1);
+    return *index>=0 && *count>0 && *count<=65536 && *index<*count;
+}
+
+// Output byte range [lo, hi) owned by shard i of n; same split as q1 --shard (even split rounded
+// down to a multiple of align: the block size for flag 0, a page otherwise)
+void shardRange(long fileSize, long i, long n, long align, long* lo, long* hi)
+{
+    *lo=(i==0)?0:(fileSize*i/n)/align*align;
+    *hi=(i==n-1)?fileSize:(fileSize*(i+1)/n)/align*align;
+}
+
+// Intersecting [lo, hi) with the segment [segStart, segStart+len), as offsets into the segment
+void segmentSlice(long lo, long hi, long segStart, long len, long* from, long* to)
+{
+    *from=lo-segStart;
+    *to=hi-segStart;
+    if(*from<0)
+    {
+        *from=0;
+    }
+    if(*to>len)
+    {
+        *to=len;
+    }
+    if(*to<*from)
+    {
+        *to=*from;
+    }
+}
+
+// Content checks work on W-byte elements (W = 1, 2, 4, 8 or 16, matching q1 --width); W = 1 is plain
+// bytes. Each width gets its own kernel, specialised at compile time from the masks below.
+
+// Shuffle masks built at compile time per element width W: rev/swap act on two 16-byte lanes
+// (pshufb), rev64 on a whole 64-byte vector (vpermb). rev reverses the order of the elements,
+// swap reverses the bytes inside each element.
+template<int W>
+struct LaneMasks
+{
+    unsigned char rev[32],swap[32],rev64[64];
+    constexpr LaneMasks() : rev(), swap(), rev64()
+    {
+        for(int k=0;k<32;k++)
+        {
+            int l=k%16;
+            rev[k]=(unsigned char)((16/W-1-l/W)*W+l%W);
+            swap[k]=(unsigned char)((l/W)*W+(W-1-l%W));
+        }
+        for(int k=0;k<64;k++)
+        {
+            rev64[k]=(unsigned char)((64/W-1-k/W)*W+k%W);
+        }
+    }
+};
+template<int W> constexpr LaneMasks<W> laneMasks=LaneMasks<W>();
+
+// Checking if buffer a[] holds the W-byte elements of buffer b[] in reverse order, for n bytes.
+// a[] is walked forwards and b[] backwards one vector at a time; each vector of b[] is
+// element-reversed in-register (pshufb/vpermb) and compared against a[] in one go
+template<int W>
 int isReverse(const char* a, const char* b, long n)
 {
-    for(long i=0;i<n;i++)
+    long i=0;
+#if defined(__AVX512VBMI__) && defined(__AVX512BW__)
+    const __m512i rev=_mm512_loadu_si512(laneMasks<W>.rev64);
+    for(;i+64<=n;i+=64)
+    {
+        __m512i va=_mm512_loadu_si512(a+i);
+        __m512i vb=_mm512_maskz_permutexvar_epi8(~0ULL,rev,_mm512_loadu_si512(b+n-i-64)); // maskz form avoids an undefined pass-through operand
+        if(_mm512_cmpneq_epi8_mask(va,vb)!=0)
+        {
+            return 0;
+        }
+    }
+#elif defined(__AVX2__)
+    const __m256i rev=_mm256_loadu_si256((const __m256i*)laneMasks<W>.rev);
+    for(;i+32<=n;i+=32)
+    {
+        __m256i va=_mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i vb=_mm256_loadu_si256((const __m256i*)(b+n-i-32));
+        vb=_mm256_permute4x64_epi64(_mm256_shuffle_epi8(vb,rev),0x4E); // reverse in lanes, then swap lanes
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va,vb))!=-1)
+        {
+            return 0;
+        }
+    }
+#elif defined(__SSSE3__)
+    const __m128i rev=_mm_loadu_si128((const __m128i*)laneMasks<W>.rev);
+    for(;i+16<=n;i+=16)
+    {
+        __m128i va=_mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(b+n-i-16)),rev);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(va,vb))!=0xFFFF)
+        {
+            return 0;
+        }
+    }
+#endif
+    if(W==1)
+    {
+        // Portable byte path (and vector tail): 8 bytes at a time via byte swap
+        for(;i+8<=n;i+=8)
+        {
+            unsigned long long x,y;
+            memcpy(&x,a+i,8);
+            memcpy(&y,b+n-i-8,8);
+            if(x!=__builtin_bswap64(y))
+            {
+                return 0;
+            }
+        }
+    }
+    for(;i+W<=n;i+=W)
+    {
+        if(memcmp(a+i,b+n-i-W,W)!=0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Checking if every W-byte element of a[] is the byte-swapped element of b[] at the same position
+template<int W>
+int isSwapped(const char* a, const char* b, long n)
+{
+    long i=0;
+#if defined(__AVX2__)
+    const __m256i m=_mm256_loadu_si256((const __m256i*)laneMasks<W>.swap);
+    for(;i+32<=n;i+=32)
+    {
+        __m256i va=_mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i vb=_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(b+i)),m);
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va,vb))!=-1)
+        {
+            return 0;
+        }
+    }
+#elif defined(__SSSE3__)
+    const __m128i m=_mm_loadu_si128((const __m128i*)laneMasks<W>.swap);
+    for(;i+16<=n;i+=16)
     {
-        if(a[i]!=b[n-1-i])
+        __m128i va=_mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(b+i)),m);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(va,vb))!=0xFFFF)
         {
             return 0;
         }
     }
+#endif
+    for(;i+W<=n;i+=W)
+    {
+        for(int k=0;k<W;k++)
+        {
+            if(a[i+k]!=b[i+W-1-k])
+            {
+                return 0;
+            }
+        }
+    }
     return 1;
 }
 
+// Dispatching to the reverse-compare kernel for a run-time element width
+int isReverseWidth(const char* a, const char* b, long n, int width)
+{
+    switch(width)
+    {
+        case 2: return isReverse<2>(a,b,n);
+        case 4: return isReverse<4>(a,b,n);
+        case 8: return isReverse<8>(a,b,n);
+        case 16: return isReverse<16>(a,b,n);
+        default: return isReverse<1>(a,b,n);
+    }
+}
+
+// Checking an in-order segment: plain comparison, or per-element byte swap when width > 1
+int isSameWidth(const char* a, const char* b, long n, int width)
+{
+    switch(width)
+    {
+        case 2: return isSwapped<2>(a,b,n);
+        case 4: return isSwapped<4>(a,b,n);
+        case 8: return isSwapped<8>(a,b,n);
+        case 16: return isSwapped<16>(a,b,n);
+        default: return memcmp(a,b,n)==0;
+    }
+}
+
+// Mapping a whole file read-only with the given access advice; returns NULL on failure.
+// Empty files cannot be mapped, so they get a dummy non-NULL pointer with size 0
+const char* mapFile(const char* path, long* size, int advice)
+{
+    int fd=open(path,O_RDONLY);
+    if(fd<0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd,&st)<0)
+    {
+        close(fd);
+        return NULL;
+    }
+    *size=st.st_size;
+    if(*size==0)
+    {
+        close(fd);
+        return "";
+    }
+    void* p=mmap(NULL,*size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd); // the mapping keeps its own reference to the file
+    if(p==MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(p,*size,advice);
+    return (const char*)p;
+}
+
+// Releasing a mapping obtained from mapFile()
+void unmapFile(const char* p, long size)
+{
+    if(p!=NULL && size>0)
+    {
+        munmap((void*)p,size);
+    }
+}
+
+// Asking the kernel to start reading [off, off+len) of a mapping (clamped to the file) ahead of use
+void prefetch(const char* base, long size, long off, long len)
+{
+    if(off<0)
+    {
+        len+=off;
+        off=0;
+    }
+    if(off+len>size)
+    {
+        len=size-off;
+    }
+    if(len<=0)
+    {
+        return;
+    }
+    long page=sysconf(_SC_PAGESIZE);
+    long aligned=off/page*page;
+    madvise((void*)(base+aligned),len+(off-aligned),MADV_WILLNEED);
+}
+
+//------------WINDOW SIZE TUNING------------
+
+// Flags 1 and 2 verify in windows: while one window is compared, the next one is prefetched with
+// MADV_WILLNEED in both files. The first window size comes from the files' preferred I/O size
+// (st_blksize) and the largest one is bounded by available memory. Over the first TUNE_BUDGET bytes each
+// size is timed for at least TUNE_PROBE bytes, doubling until throughput drops, and the best is kept.
+const long TUNE_MIN_CHUNK=256*1024;
+const long TUNE_MAX_CHUNK=64*1024*1024;
+const long TUNE_PROBE=16*1024*1024;
+const long TUNE_BUDGET=384*1024*1024;
+
+struct Tuner
+{
+    long chunk;           // window in use
+    long maxChunk;        // largest window that may be tried
+    int settled,manual;
+    long probeBytes;      // bytes verified with the current window size
+    long long probeStart; // when the current window size started (ns)
+    long spent;           // bytes verified while tuning
+    long bestChunk;
+    double bestRate;
+};
+
+// Monotonic clock in nanoseconds
+long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+// Setting up the tuner from both files' hints; fixedChunk (0 = automatic) comes from --chunk
+void tunerInit(Tuner* t, const char* newFile, const char* oldFile, long fixedChunk)
+{
+    struct stat st;
+    long hint=0;
+    if(stat(newFile,&st)==0)
+    {
+        hint=st.st_blksize;
+    }
+    if(stat(oldFile,&st)==0 && st.st_blksize>hint)
+    {
+        hint=st.st_blksize;
+    }
+    long first=TUNE_MIN_CHUNK;
+    while(first<hint*4 && first<TUNE_MAX_CHUNK)
+    {
+        first*=2;
+    }
+    long avail=sysconf(_SC_AVPHYS_PAGES)*sysconf(_SC_PAGESIZE);
+    t->maxChunk=TUNE_MAX_CHUNK;
+    while(t->maxChunk>first && avail>0 && t->maxChunk>avail/64)
+    {
+        t->maxChunk/=2;
+    }
+    t->chunk=first;
+    t->manual=(fixedChunk>0);
+    if(t->manual)
+    {
+        t->chunk=fixedChunk;
+        t->maxChunk=fixedChunk;
+    }
+    t->settled=t->manual;
+    t->probeBytes=0;
+    t->probeStart=nowNs();
+    t->spent=0;
+    t->bestChunk=t->chunk;
+    t->bestRate=0;
+}
+
+// Accounting for bytes verified with the current window; moves on to the next size once a probe is complete
+void tunerRecord(Tuner* t, long bytes)
+{
+    if(t->settled)
+    {
+        return;
+    }
+    t->probeBytes+=bytes;
+    t->spent+=bytes;
+    long probeLen=(t->chunk*4>TUNE_PROBE)?t->chunk*4:TUNE_PROBE;
+    if(t->probeBytes<probeLen)
+    {
+        return;
+    }
+    double rate=(double)t->probeBytes/(double)(nowNs()-t->probeStart+1);
+    int worse=(rate<t->bestRate*0.95); // small dips are measurement noise
+    if(rate>t->bestRate)
+    {
+        t->bestRate=rate;
+        t->bestChunk=t->chunk;
+    }
+    if(!worse && t->chunk*2<=t->maxChunk && t->spent<TUNE_BUDGET)
+    {
+        t->chunk*=2;
+        t->probeBytes=0;
+        t->probeStart=nowNs();
+        return;
+    }
+    t->chunk=t->bestChunk;
+    t->settled=1;
+}
+
 // Printing permission checks for user/group/others on a given file or directory
 void printPermissionsFor(const char* name, struct stat *st)
 {
@@ -115,207 +516,450 @@ void printPermissionsFor(const char* name, struct stat *st)
 
 //--------------CONTENT CHECK FUNCTIONS---------------
 
+// Each check verifies the bytes [lo, hi) of the new file (the whole file unless --shard is given).
+// revWidth is the element width of reversed parts; swapWidth is the element width at which in-order
+// parts are byte-swapped (1 = unchanged). q1 --width W gives revWidth W; adding --bswap gives
+// revWidth 1 (a full byte reversal) and swapWidth W.
+
 // Flag 0: Block wise reversal
-int checkFlag0(const char* newFile, const char* oldFile, long blockSize)
+int checkFlag0(const char* newFile, const char* oldFile, long blockSize, int revWidth, long lo, long hi)
 {
-    int fd_new=open(newFile,O_RDONLY);
-    int fd_old=open(oldFile,O_RDONLY);
-    if(fd_new<0 || fd_old<0)
-    {
-        return 0;
-    }
-    char* buf_new=(char*)mmap(NULL,blockSize,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
-    char* buf_old=(char*)mmap(NULL,blockSize,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
-    if(buf_new==MAP_FAILED || buf_old==MAP_FAILED)
+    long newSize=0,oldSize=0;
+    const char* map_new=mapFile(newFile,&newSize,MADV_SEQUENTIAL);
+    const char* map_old=mapFile(oldFile,&oldSize,MADV_SEQUENTIAL);
+    int ok=(map_new!=NULL && map_old!=NULL && newSize==oldSize && blockSize>0);
+
+    if(hi>newSize)
     {
-        return 0;
+        hi=newSize;
     }
-
-    int ok=1;
-    ssize_t r1,r2;
-
-    while(1)
+    for(long off=lo;ok && off<hi;off+=blockSize)
     {
-        r1=read(fd_new,buf_new,blockSize);
-        r2=read(fd_old,buf_old,blockSize);
-
-        if(r1!=r2)
-        { 
-            ok=0;
-            break;
-        }
-        if(r1<=0)
-        {
-            break;
-        }
-        if(!isReverse(buf_new,buf_old,r1))
+        long sz=(blockSize<(hi-off))?blockSize:(hi-off);
+        DTRACE_PROBE2(q2,compare_begin,off,sz);
+        if(!isReverseWidth(map_new+off,map_old+off,sz,revWidth))
         {
+            DTRACE_PROBE2(q2,mismatch,off,sz);
             ok=0;
-            break;
         }
+        DTRACE_PROBE2(q2,compare_end,off,sz);
     }
 
-    munmap(buf_new,blockSize);
-    munmap(buf_old,blockSize);
-    close(fd_new);
-    close(fd_old);
+    unmapFile(map_new,newSize);
+    unmapFile(map_old,oldSize);
     return ok;
 }
 
 // Flag 1: Full file reversal
-int checkFlag1(const char* newFile, const char* oldFile, long chunkSize)
+int checkFlag1(const char* newFile, const char* oldFile, int revWidth, Tuner* tuner, long lo, long hi)
 {
-    int fd_new=open(newFile,O_RDONLY);
-    int fd_old=open(oldFile,O_RDONLY);
-    if(fd_new<0 || fd_old<0)
-    {
-        return 0;
-    }
-    struct stat st;
-    if(stat(newFile,&st)<0)
+    long fileSize=0,oldSize=0;
+    const char* map_new=mapFile(newFile,&fileSize,MADV_SEQUENTIAL);
+    const char* map_old=mapFile(oldFile,&oldSize,MADV_SEQUENTIAL);
+    int ok=(map_new!=NULL && map_old!=NULL && fileSize==oldSize);
+
+    // new[offset...offset+sz-1] must be the reverse of old[fileSize-offset-sz...fileSize-offset-1]
+    if(hi>fileSize)
     {
-        return 0;
+        hi=fileSize;
     }
-    long fileSize=st.st_size;
-    long offset=0;
-    char* buf_new=(char*)mmap(NULL,chunkSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
-    char* buf_old=(char*)mmap(NULL,chunkSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
-    int ok=1;
-    while(offset<fileSize)
+    long offset=lo;
+    while(ok && offset<hi)
     {
-        long sz=(chunkSize<(fileSize-offset))?chunkSize:(fileSize-offset);
-        lseek(fd_old, offset, SEEK_SET);
-        read(fd_old,buf_old,sz);
-        lseek(fd_new,fileSize-offset-sz,SEEK_SET);
-        read(fd_new,buf_new,sz);
-        if(!isReverse(buf_new,buf_old,sz))
+        long sz=(tuner->chunk<(hi-offset))?tuner->chunk:(hi-offset);
+        prefetch(map_new,fileSize,offset+sz,tuner->chunk);
+        prefetch(map_old,fileSize,fileSize-offset-sz-tuner->chunk,tuner->chunk);
+        DTRACE_PROBE2(q2,compare_begin,offset,sz);
+        if(!isReverseWidth(map_new+offset,map_old+fileSize-offset-sz,sz,revWidth))
         {
+            DTRACE_PROBE2(q2,mismatch,offset,sz);
             ok=0;
-            break;
         }
+        DTRACE_PROBE2(q2,compare_end,offset,sz);
+        tunerRecord(tuner,sz);
         offset+=sz;
     }
 
-    munmap(buf_new,chunkSize);
-    munmap(buf_old,chunkSize);
-    close(fd_new);
-    close(fd_old);
-
+    unmapFile(map_new,fileSize);
+    unmapFile(map_old,oldSize);
     return ok;
 }
 
 // Flag 2: Partial range reversal
-int checkFlag2(const char* newFile, const char* oldFile, long start, long end, long chunkSize)
+int checkFlag2(const char* newFile, const char* oldFile, long start, long end, int revWidth, int swapWidth,
+               Tuner* tuner, long lo, long hi)
 {
-    struct stat st;
-    if(stat(oldFile,&st)<0)
-    {
-        return 0;
-    }
-    long fileSize=st.st_size;
+    long fileSize=0,newSize=0;
+    const char* map_new=mapFile(newFile,&newSize,MADV_SEQUENTIAL);
+    const char* map_old=mapFile(oldFile,&fileSize,MADV_SEQUENTIAL);
+    int ok=(map_new!=NULL && map_old!=NULL && newSize==fileSize);
     if(start>=fileSize || end >= fileSize || start >= end)
     {
-        return 0;
+        ok=0;
     }
-    int fd_new=open(newFile,O_RDONLY);
-    int fd_old=open(oldFile,O_RDONLY);
-    if(fd_new<0 || fd_old<0)
-    {
-        return 0;
-    }
-    char* buf_new=(char*)mmap(NULL,chunkSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
-    char* buf_old=(char*)mmap(NULL,chunkSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
-    int ok=1;
 
     // Part A: Before start-should be reversed
     long len1=start;
-    long off=0;
-    while(off<len1&&ok)
+    long off,to;
+    segmentSlice(lo,hi,0,len1,&off,&to);
+    DTRACE_PROBE3(q2,part,0,off,to-off);
+    while(off<to&&ok)
     {
         long sz;
-        if(chunkSize<(len1-off))
+        if(tuner->chunk<(to-off))
         {
-            sz=chunkSize;
+            sz=tuner->chunk;
         }
         else
         {
-            sz=len1-off;
+            sz=to-off;
         }
-        lseek(fd_new,off,SEEK_SET);read(fd_new,buf_new,sz);
-        lseek(fd_old,len1-off-sz,SEEK_SET);read(fd_old,buf_old,sz);
-        if(!isReverse(buf_new,buf_old,sz))
+        prefetch(map_new,fileSize,off+sz,tuner->chunk);
+        prefetch(map_old,fileSize,len1-off-sz-tuner->chunk,tuner->chunk);
+        DTRACE_PROBE2(q2,compare_begin,off,sz);
+        if(!isReverseWidth(map_new+off,map_old+len1-off-sz,sz,revWidth))
         {
+            DTRACE_PROBE2(q2,mismatch,off,sz);
             ok=0;
         }
+        DTRACE_PROBE2(q2,compare_end,off,sz);
+        tunerRecord(tuner,sz);
         off+=sz;
     }
 
     // Part B: Middle section-unchanged
     long len2=end-start+1;
-    off=0;
-    while(ok && off<len2)
+    segmentSlice(lo,hi,start,len2,&off,&to);
+    DTRACE_PROBE3(q2,part,1,start+off,to-off);
+    while(ok && off<to)
     {
         long sz;
-        if(chunkSize<(len2-off))
+        if(tuner->chunk<(to-off))
         {
-            sz=chunkSize;
+            sz=tuner->chunk;
         }
         else
         {
-            sz=len2-off;
+            sz=to-off;
         }
-        lseek(fd_new,start+off,SEEK_SET);
-        read(fd_new,buf_new,sz);
-        lseek(fd_old,start+off,SEEK_SET);
-        read(fd_old,buf_old,sz);
-        for(long i=0;i<sz;i++)
+        prefetch(map_new,fileSize,start+off+sz,tuner->chunk);
+        prefetch(map_old,fileSize,start+off+sz,tuner->chunk);
+        DTRACE_PROBE2(q2,compare_begin,start+off,sz);
+        if(!isSameWidth(map_new+start+off,map_old+start+off,sz,swapWidth))
         {
-            if(buf_new[i]!=buf_old[i])
-            {   
-                ok=0;
-                break;
-            }
+            DTRACE_PROBE2(q2,mismatch,start+off,sz);
+            ok=0;
         }
+        DTRACE_PROBE2(q2,compare_end,start+off,sz);
+        tunerRecord(tuner,sz);
         off+=sz;
     }
 
     // Part C: After end-should be reversed
     long len3=fileSize-end-1;
-    off=0;
-    while(ok && off<len3)
+    segmentSlice(lo,hi,end+1,len3,&off,&to);
+    DTRACE_PROBE3(q2,part,2,end+1+off,to-off);
+    while(ok && off<to)
     {
         long sz;
-        if(chunkSize<(len3-off))
+        if(tuner->chunk<(to-off))
         {
-            sz=chunkSize;
+            sz=tuner->chunk;
         }
         else
         {
-            sz=len3-off;
+            sz=to-off;
         }
-        lseek(fd_new,end+1+off,SEEK_SET);
-        read(fd_new,buf_new,sz);
-        lseek(fd_old,fileSize-(off+sz),SEEK_SET);
-        read(fd_old,buf_old,sz);
-        if(!isReverse(buf_new,buf_old,sz))
+        prefetch(map_new,fileSize,end+1+off+sz,tuner->chunk);
+        prefetch(map_old,fileSize,fileSize-(off+sz)-tuner->chunk,tuner->chunk);
+        DTRACE_PROBE2(q2,compare_begin,end+1+off,sz);
+        if(!isReverseWidth(map_new+end+1+off,map_old+fileSize-(off+sz),sz,revWidth))
         {
+            DTRACE_PROBE2(q2,mismatch,end+1+off,sz);
             ok=0;
         }
+        DTRACE_PROBE2(q2,compare_end,end+1+off,sz);
+        tunerRecord(tuner,sz);
         off+=sz;
     }
 
-    munmap(buf_new, chunkSize);
-    munmap(buf_old, chunkSize);
-    close(fd_new);
-    close(fd_old);
-
+    unmapFile(map_new,newSize);
+    unmapFile(map_old,fileSize);
     return ok;
 }
 
+//--------------SAMPLING VERIFICATION---------------
+
+// --sample K --seed S: instead of a full pass, K chunks of the new file (within [lo, hi)) are verified.
+// Chunks are drawn per segment - the blocks for flag 0, the file for flag 1, parts A/B/C for flag 2 -
+// with samples split across segments in proportion to their size (at least one each). Inside a
+// segment the chunks are split into equal strata and one random chunk is taken from each stratum,
+// so samples are distinct, spread over the whole segment and reproducible from the seed.
+
+// One stretch of the new file that maps to the old file in a single way. For a reversed segment
+// [a, b), new bytes [o, o+sz) are the old bytes [a+b-o-sz, a+b-o) reversed; in-order segments map to
+// the same offsets; blockwise segments (flag 0) are reversed block by block.
+struct Segment
+{
+    long from,to;   // part of the new file covered, clipped to [lo, hi)
+    long a,b;       // whole segment
+    int kind;       // 0 = in order, 1 = reversed, 2 = reversed block by block
+};
+
+struct SampleStats
+{
+    long sampled,passed;
+    long bytesChecked,bytesInRange;
+    long unit;
+    unsigned long long seed;
+};
+
+// splitmix64: small, seedable generator for reproducible chunk choices
+unsigned long long nextRandom(unsigned long long* state)
+{
+    unsigned long long z=(*state+=0x9e3779b97f4a7c15ULL);
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+// Verifying new bytes [o, o+sz) of one segment against the old file
+int verifySample(const char* map_new, const char* map_old, const Segment* seg, long o, long sz,
+                 long blockSize, int revWidth, int swapWidth)
+{
+    if(seg->kind==0)
+    {
+        return isSameWidth(map_new+o,map_old+o,sz,swapWidth);
+    }
+    if(seg->kind==1)
+    {
+        return isReverseWidth(map_new+o,map_old+seg->a+seg->b-o-sz,sz,revWidth);
+    }
+    for(long off=o;off<o+sz;off+=blockSize)
+    {
+        long bsz=(blockSize<(o+sz-off))?blockSize:(o+sz-off);
+        if(!isReverseWidth(map_new+off,map_old+off,bsz,revWidth))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sampled check of any flag. unit is the chunk size (whole blocks for flag 0, whole elements otherwise).
+// Returns 1 if every sampled chunk matched.
+int checkSampled(const char* newFile, const char* oldFile, int flag, long blockSize, long start, long end,
+                 int revWidth, int swapWidth, long lo, long hi, long samples, SampleStats* stats)
+{
+    long fileSize=0,newSize=0;
+    const char* map_new=mapFile(newFile,&newSize,MADV_RANDOM);
+    const char* map_old=mapFile(oldFile,&fileSize,MADV_RANDOM);
+    int ok=(map_new!=NULL && map_old!=NULL && newSize==fileSize);
+    if(flag==2 && (start>=fileSize || end>=fileSize || start>=end))
+    {
+        ok=0;
+    }
+    if(flag==0 && blockSize<=0)
+    {
+        ok=0;
+    }
+    if(hi>fileSize)
+    {
+        hi=fileSize;
+    }
+
+    // Segments of the file, clipped to this shard
+    Segment segs[3];
+    int nseg=0;
+    if(flag==0)
+    {
+        segs[nseg++]={lo,hi,0,fileSize,2};
+    }
+    else if(flag==1)
+    {
+        segs[nseg++]={lo,hi,0,fileSize,1};
+    }
+    else
+    {
+        segs[nseg++]={0,start,0,start,1};
+        segs[nseg++]={start,end+1,start,end+1,0};
+        segs[nseg++]={end+1,fileSize,end+1,fileSize,1};
+    }
+    long total=0;
+    for(int k=0;k<nseg;k++)
+    {
+        if(segs[k].from<lo)
+        {
+            segs[k].from=lo;
+        }
+        if(segs[k].to>hi)
+        {
+            segs[k].to=hi;
+        }
+        if(segs[k].to<segs[k].from)
+        {
+            segs[k].to=segs[k].from;
+        }
+        total+=segs[k].to-segs[k].from;
+    }
+    stats->bytesInRange=total;
+
+    unsigned long long state=stats->seed;
+    long before=0; // bytes in earlier segments, so the shares add up to exactly K
+    for(int k=0;ok && k<nseg;k++)
+    {
+        long len=segs[k].to-segs[k].from;
+        if(len==0)
+        {
+            continue;
+        }
+        long chunks=(len+stats->unit-1)/stats->unit;
+        long want=(long)((double)samples*(before+len)/total+0.5)-(long)((double)samples*before/total+0.5);
+        before+=len;
+        if(want<1)
+        {
+            want=1;
+        }
+        if(want>chunks)
+        {
+            want=chunks;
+        }
+        for(long j=0;j<want;j++)
+        {
+            long first=j*chunks/want,last=(j+1)*chunks/want; // stratum [first, last)
+            long idx=first+(long)(nextRandom(&state)%(unsigned long long)(last-first));
+            long o=segs[k].from+idx*stats->unit;
+            long sz=(stats->unit<(segs[k].to-o))?stats->unit:(segs[k].to-o);
+            stats->sampled++;
+            stats->bytesChecked+=sz;
+            DTRACE_PROBE2(q2,compare_begin,o,sz);
+            if(verifySample(map_new,map_old,&segs[k],o,sz,blockSize,revWidth,swapWidth))
+            {
+                stats->passed++;
+            }
+            else
+            {
+                DTRACE_PROBE2(q2,mismatch,o,sz);
+                ok=0;
+            }
+            DTRACE_PROBE2(q2,compare_end,o,sz);
+        }
+    }
+
+    unmapFile(map_new,newSize);
+    unmapFile(map_old,fileSize);
+    return ok && stats->passed==stats->sampled;
+}
+
+// Writing a fraction as a percentage with two decimals
+void fdWritePercent(int fd, double fraction)
+{
+    long v=(long)(fraction*10000+0.5);
+    fdWriteLong(fd,v/100);
+    fdWriteStr(fd,".");
+    if(v%100<10)
+    {
+        fdWriteStr(fd,"0");
+    }
+    fdWriteLong(fd,v%100);
+    fdWriteStr(fd,"%");
+}
+
+// Reporting a sampled run: pass count, the 95% upper bound on the fraction of bad chunks (exact
+// binomial bound for zero failures, 1-0.05^(1/n)) and how much reading the sample saved. When K
+// covered every chunk there is nothing left to bound, so the run is reported as a full verification.
+void printSampleStats(const SampleStats* st)
+{
+    fdWriteStr(1,"Sampled chunks passed: ");
+    fdWriteLong(1,st->passed);
+    fdWriteStr(1," of ");
+    fdWriteLong(1,st->sampled);
+    fdWriteStr(1," (chunk ");
+    fdWriteLong(1,st->unit);
+    fdWriteStr(1," bytes, seed ");
+    fdWriteLong(1,(long)(st->seed&0x7fffffffffffffffULL));
+    fdWriteStr(1,")\n");
+    if(st->sampled>0 && st->passed==st->sampled)
+    {
+        if(st->bytesChecked==st->bytesInRange)
+        {
+            fdWriteStr(1,"Every chunk in range was checked: full verification, no sampling error\n");
+        }
+        else
+        {
+            fdWriteStr(1,"With 95% confidence at most ");
+            fdWritePercent(1,1.0-pow(0.05,1.0/st->sampled));
+            fdWriteStr(1," of chunks are incorrect\n");
+        }
+    }
+    fdWriteStr(1,"I/O avoided: ");
+    fdWriteLong(1,2*(st->bytesInRange-st->bytesChecked));
+    fdWriteStr(1," of ");
+    fdWriteLong(1,2*st->bytesInRange);
+    fdWriteStr(1," bytes (");
+    fdWritePercent(1,st->bytesInRange>0?(double)(st->bytesInRange-st->bytesChecked)/st->bytesInRange:0.0);
+    fdWriteStr(1,")\n");
+}
+
 //------------------MAIN------------------
 
 int main(int argc, char* argv[])
 {
+    // Separate --options from positional arguments
+    char* args[8];
+    int nargs=0;
+    long shardIndex=0,shardCount=0,fixedChunk=0,width=1,samples=0,seed=0;
+    int bswap=0;
+    for(int i=0;i<argc;i++)
+    {
+        if(i>0 && argv[i][0]=='-' && argv[i][1]=='-')
+        {
+            if(strEqual(argv[i],"--shard") && i+1<argc && parseShard(argv[i+1],&shardIndex,&shardCount))
+            {
+                i++;
+            }
+            else if(strEqual(argv[i],"--chunk") && i+1<argc && (fixedChunk=convertToLong(argv[i+1]))>0)
+            {
+                i++;
+            }
+            else if(strEqual(argv[i],"--width") && i+1<argc
+                    && ((width=convertToLong(argv[i+1]))==1 || width==2 || width==4 || width==8 || width==16))
+            {
+                i++;
+            }
+            else if(strEqual(argv[i],"--bswap"))
+            {
+                bswap=1;
+            }
+            else if(strEqual(argv[i],"--sample") && i+1<argc && (samples=convertToLong(argv[i+1]))>0)
+            {
+                i++;
+            }
+            else if(strEqual(argv[i],"--seed") && i+1<argc && (seed=convertToLong(argv[i+1]))>=0)
+            {
+                i++;
+            }
+            else
+            {
+                fdWriteStr(2,"Invalid option: ");
+                fdWriteStr(2,argv[i]);
+                fdWriteStr(2,"\n");
+                _exit(1);
+            }
+        }
+        else if(nargs<8)
+        {
+            args[nargs++]=argv[i];
+        }
+        else
+        {
+            fdWriteStr(2,"Invalid arguments\n");
+            _exit(1);
+        }
+    }
+    argc=nargs;
+    argv=args;
+
     if(argc<5)
     {
         fdWriteStr(2,"Invalid arguments\n");
@@ -340,7 +984,6 @@ int main(int argc, char* argv[])
         {
             _exit(1);
         }
-        blockSize=1024*1024;
     }
     else if(flag==2)
     {
@@ -350,7 +993,6 @@ int main(int argc, char* argv[])
         }
         start=convertToLong(argv[5]);
         end=convertToLong(argv[6]);
-        blockSize=1024*1024;
     }
     else _exit(1);
     struct stat st_new,st_old,st_dir;
@@ -367,13 +1009,59 @@ int main(int argc, char* argv[])
         _exit(1);
     }
 
+    // Range of the new file to verify: all of it, or this process's shard
+    long lo=0,hi=0;
+    if(old_ok)
+    {
+        hi=st_old.st_size;
+        if(shardCount>0)
+        {
+            shardRange(st_old.st_size,shardIndex,shardCount,(flag==0 && blockSize>0)?blockSize:4096,&lo,&hi);
+        }
+    }
+
+    // Element layout: windows hold whole elements, and the file (and flag 0 blocks, flag 2 bounds)
+    // must split into whole elements for the output to be a valid element-wise transform
+    int revWidth=bswap?1:(int)width;
+    int swapWidth=bswap?(int)width:1;
+    if(fixedChunk>0)
+    {
+        fixedChunk=(fixedChunk<width)?width:fixedChunk-fixedChunk%width;
+    }
+    int layout_ok=(old_ok && st_old.st_size%width==0);
+    if(flag==0 && blockSize%width!=0)
+    {
+        layout_ok=0;
+    }
+    if(flag==2 && (start%width!=0 || (end+1)%width!=0))
+    {
+        layout_ok=0;
+    }
+
+    Tuner tuner;
+    tunerInit(&tuner,newFile,oldFile,fixedChunk);
+
     // File content validation
     int content_ok=0;
-    if(flag==0)
+    SampleStats sampleStats={0,0,0,0,0,(unsigned long long)seed};
+    if(samples>0)
     {
-        if(new_ok && old_ok)
+        // Sample chunks: the window size the tuner would start with, rounded to whole blocks for flag 0
+        sampleStats.unit=tuner.chunk;
+        if(flag==0 && blockSize>0)
+        {
+            sampleStats.unit=(sampleStats.unit<blockSize)?blockSize:sampleStats.unit-sampleStats.unit%blockSize;
+        }
+        if(new_ok && old_ok && layout_ok)
         {
-            content_ok=checkFlag0(newFile,oldFile,blockSize);
+            content_ok=checkSampled(newFile,oldFile,flag,blockSize,start,end,revWidth,swapWidth,lo,hi,samples,&sampleStats);
+        }
+    }
+    else if(flag==0)
+    {
+        if(new_ok && old_ok && layout_ok)
+        {
+            content_ok=checkFlag0(newFile,oldFile,blockSize,revWidth,lo,hi);
         }
         else
         {
@@ -383,9 +1071,9 @@ int main(int argc, char* argv[])
     }
     else if(flag==1)
     {
-        if(new_ok && old_ok)
+        if(new_ok && old_ok && layout_ok)
         {
-            content_ok=checkFlag1(newFile,oldFile,blockSize);
+            content_ok=checkFlag1(newFile,oldFile,revWidth,&tuner,lo,hi);
         }
         else
         {
@@ -394,9 +1082,9 @@ int main(int argc, char* argv[])
     }
     else if(flag==2)
     {
-        if(new_ok && old_ok)
+        if(new_ok && old_ok && layout_ok)
         {
-            content_ok=checkFlag2(newFile,oldFile,start,end,blockSize);
+            content_ok=checkFlag2(newFile,oldFile,start,end,revWidth,swapWidth,&tuner,lo,hi);
         }
         else
         {
@@ -437,5 +1125,28 @@ int main(int argc, char* argv[])
     // Permissions-directory
     printPermissionsFor("directory",&st_dir);
 
+    if(samples>0)
+    {
+        printSampleStats(&sampleStats);
+    }
+    else if(flag!=0)
+    {
+        fdWriteStr(1,"Verification window: ");
+        fdWriteLong(1,tuner.settled?tuner.chunk:tuner.bestChunk);
+        fdWriteStr(1,tuner.manual?" bytes (fixed)\n":(tuner.bestRate>0?" bytes (tuned)\n":" bytes (initial)\n"));
+    }
+    if(shardCount>0)
+    {
+        fdWriteStr(1,"Verified shard ");
+        fdWriteLong(1,shardIndex);
+        fdWriteStr(1," of ");
+        fdWriteLong(1,shardCount);
+        fdWriteStr(1,": bytes ");
+        fdWriteLong(1,lo);
+        fdWriteStr(1,"-");
+        fdWriteLong(1,hi);
+        fdWriteStr(1,"\n");
+    }
+
     return 0;
 }
\ No newline at end of file